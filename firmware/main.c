@@ -1,13 +1,15 @@
 /*
  * USB Potentiostat/galvanostat firmware
  *
- * This code makes use of Signal 11's M-Stack USB stack to implement 
- * communication through raw USB bulk transfers. Commands are received
- * as ASCII strings on EP1 OUT. They are then interpreted and executed;
- * they either change the state of output pins, or cause data to be read
- * from / written to the MCP3550 (ADC) or DAC1220 (DAC) using a software
- * SPI implementation. The resulting data, or an "OK" message, is sent as
- * a reply on EP1 IN. The USB service is interrupt-driven.
+ * This code makes use of Signal 11's M-Stack USB stack to implement
+ * communication through raw USB bulk transfers. Commands are received on
+ * EP1 OUT as ASCII strings or binary opcodes (see the command table).
+ * They are then interpreted and executed; they either change the state of
+ * output pins, or cause data to be read from / written to the MCP3550
+ * (ADC) or DAC1220 (DAC) using a software SPI implementation. The
+ * resulting data, or an "OK" message, is sent as a reply on EP1 IN. In
+ * streaming mode, conversions are also pushed on EP1 IN without being
+ * requested. The USB service and a 1 ms tick are interrupt-driven.
  *
  * Thomas Dobbelaere
  * CoCooN research group
@@ -23,6 +25,8 @@
 #include "Flash.h"
 #include "HEFlash.h"
 
+void usb_set_serial_number(const uint8_t *serial); // in usb_descriptors.c
+
 // PIC16F1459 configuration bit settings:
 // CONFIG1
 #pragma config FOSC = INTOSC    // Oscillator Selection Bits (INTOSC oscillator: I/O function on CLKIN pin)
@@ -64,15 +68,384 @@
 #define RANGE2_TRIS TRISCbits.TRISC5
 #define RANGE3_PIN LATCbits.LATC6
 #define RANGE3_TRIS TRISCbits.TRISC6
+#define STREAM_FRAME_MARKER 0xA5 // first byte of a data frame pushed in streaming mode
+#define STREAM_HEADER_LEN 10 // marker, frame counter, sample count, flags, tick of first sample (4 bytes, LSB first), decimation factor, overflow counter
+#define STREAM_SAMPLE_LEN 6 // raw potential and current, 3 bytes each
+#define STREAM_MAX_SAMPLES ((EP_1_IN_LEN-STREAM_HEADER_LEN)/STREAM_SAMPLE_LEN) // 9: a tenth sample would need 70 bytes, more than a full-speed bulk packet holds
+#define STREAM_DEFAULT_LATENCY 100 // "STREAM LATENCY" set by "STREAM START" (ms); packs several samples per frame at short acquisition periods
+#ifdef EP1_PINGPONG
+#define STREAM_RING_SIZE 11 // the second EP1 IN buffer holds another full frame, so as many samples are buffered as without ping-pong
+#else
+#define STREAM_RING_SIZE 20 // samples buffered while EP1 IN is busy (12 bytes each)
+#endif
+#define STREAM_FLAG_RANGE 0x03 // bits 0-1: current range (0-2) of the samples in the frame
+#define STREAM_FLAG_GALVANOSTATIC 0x04
+#define STREAM_FLAG_CELL_ON 0x08
+#define STREAM_FLAG_SWEEP 0x10 // a CV sweep or waveform playback is in progress
+#define STREAM_FLAG_CD 0x20 // the charge/discharge controller is running
+#define STREAM_FLAG_CD_PHASE 0x40 // set during the second phase of a charge/discharge cycle
+#define STREAM_FLAG_INVALID 0x80 // the samples were taken while the range relays were switching
+#define RELAY_MAKE_TIME 10 // time between making the new relay setting and breaking the old one (ms)
+#define DAC_SELFCAL_TIME 500 // time the DAC1220 needs for a self-calibration (ms)
+#define MAX_DELAY 1000 // longest "DELAY" (ms)
+#define WAVE_CHUNK_CODES 20 // DAC codes per WAVEDATA command, filling most of a 64-byte packet
+#define WAVE_FIFO_SIZE 40 // DAC codes buffered for waveform playback (3 bytes each)
+
+#define COMMAND_OPCODE_BASE 0x80 // first opcode of the binary protocol; ASCII commands never start with such a byte
+#define NUM_COMMANDS (sizeof(commands)/sizeof(commands[0]))
+#define COMMAND_BATCH 0xFF // a packet starting with this byte holds a sequence of binary commands
+#define MAX_REPLY_LENGTH (CAL_BLOCKS*CALIBRATION_LENGTH) // longest reply of a single command (CALREAD)
+#define SERIAL_NUMBER_ROW 0 // HEFLASH row holding the USB serial number
+#define CALIBRATION_LENGTH 6 // bytes in each calibration block
+#define CAL_BLOCK_OFFSET 0 // potential and current offset
+#define CAL_BLOCK_DAC 1 // DAC1220 offset and gain calibration
+#define CAL_BLOCK_SHUNT 2 // shunt calibration values
+#define CAL_BLOCKS 3
+#define CAL_LOG_FIRST_ROW 1 // HEFLASH rows from here to the last one hold the calibration log
+#define CAL_LOG_ROWS (HEFLASH_MAXROWS - CAL_LOG_FIRST_ROW)
+#define CAL_RECORD_LENGTH (3 + CALIBRATION_LENGTH) // format version and block, sequence counter, calibration block, CRC-8
+#define CAL_RECORDS_PER_ROW (FLASH_ROWSIZE / CAL_RECORD_LENGTH)
+#define CAL_LOG_SLOTS (CAL_LOG_ROWS * CAL_RECORDS_PER_ROW)
+#if CAL_RECORDS_PER_ROW < CAL_BLOCKS || CAL_LOG_ROWS < 2
+#error "a started row must hold a record of every block, next to a spare row (see cal_start_row())"
+#endif
+#define CAL_RECORD_VERSION 1 // upper nibble of the first record byte; records of other versions are ignored
+#define CAL_SLOT_NONE 0xFF
+#define FLASH_ERASED 0x3FFF // content of an erased flash word; stored bytes read back as 0x00-0xFF
+
+// Performance counters ("make STATS=1"): execution times are measured in counts of the free-running
+// Timer1 (3 MHz, i.e. 4 instruction cycles per count, wrapping every 21.8 ms) and read back with "STATS"
+#ifdef PERF_STATS
+#define PERF_ADC_READ 0 // MCP3550 result read (SPI transaction), only counted when a result was ready
+#define PERF_DAC_WRITE 1 // DAC1220 setpoint write (SPI transaction)
+#define PERF_USB_SERVICE 2 // usb_service() in the interrupt routine, only counted when a USB interrupt was pending
+#define PERF_INTERPRET 3 // interpret_command(), including the command lookup
+#define PERF_COMMAND 4 // handler of the command selected with "STATS <opcode>"
+#define PERF_COUNTERS 5
+#define PERF_COMMAND_NONE 0xFF // no command selected for timing
+#define PERF_STATS_EVENTS 0xFE // "STATS" argument that returns the event counters
+#define PERF_STATS_RESET 0xFF // "STATS" argument that clears all counters
+#define PERF_BEGIN(start) uint16_t start = perf_timer()
+#define PERF_END(start, counter) perf_record(counter, perf_timer() - start)
+#define PERF_EVENT(event) perf_events.event++
+#define PERF_MEASURE_COMMAND(index, statement) do { PERF_BEGIN(perf_start); statement; if ((index) == perf_command) PERF_END(perf_start, &perf_counters[PERF_COMMAND]); } while (0)
+#else
+#define PERF_BEGIN(start)
+#define PERF_END(start, counter)
+#define PERF_EVENT(event)
+#define PERF_MEASURE_COMMAND(index, statement) do { statement; } while (0)
+#endif
+#define PERF_MEASURE(counter, statement) do { PERF_BEGIN(perf_start); statement; PERF_END(perf_start, counter); } while (0)
+
+struct stream_sample {
+	uint32_t tick; // tick at which the (first averaged) conversion was started
+	uint8_t flags;
+	uint8_t decimation;
+	uint8_t data[STREAM_SAMPLE_LEN];
+};
+
+struct cd_phase {
+	uint8_t dac[3]; // DAC setpoint (DAC format)
+	uint8_t range; // current range (0-2)
+	int32_t limit; // raw ADC potential at which the phase ends
+	uint8_t rising; // 1 if the phase ends when the potential exceeds the limit, 0 if it ends below
+};
 
 static const uint8_t* received_data;
 static uint8_t received_data_length;
 static uint8_t* transmit_data;
 static uint8_t transmit_data_length;
-static uint8_t heflashbuffer[FLASH_ROWSIZE];
+static uint8_t calibration_blocks[CAL_BLOCKS][CALIBRATION_LENGTH]; // latest saved value of each block, all bits set if it was never saved
+static uint8_t cal_block_slot[CAL_BLOCKS]; // log slot holding the latest record of each block, or CAL_SLOT_NONE
+static uint8_t cal_log_head = CAL_SLOT_NONE; // log slot of the latest record, or CAL_SLOT_NONE if the log is empty
+static uint8_t cal_sequence = 0; // sequence counter of the latest record (wraps around)
+
+#ifdef PERF_STATS
+struct perf_counter {
+	uint16_t count; // number of measurements, saturating
+	uint16_t min; // Timer1 counts
+	uint16_t max;
+	uint32_t sum;
+};
+
+static struct perf_counter perf_counters[PERF_COUNTERS]; // 10 bytes each, so a counter per command would not fit in RAM
+static uint8_t perf_command = PERF_COMMAND_NONE; // index in the command table of the command timed in perf_counters[PERF_COMMAND]
+static struct {
+	uint16_t wait_replies; // "WAIT" replies to ADCREAD and CALSTATUS
+	uint16_t ep1_busy; // main loop passes in which a received command had to wait for EP1 IN
+	uint16_t dropped_samples; // streamed samples lost because the ring buffer was full
+} perf_events;
+
+uint16_t perf_timer()
+{
+	uint8_t high, low;
+	do // the two halves of Timer1 cannot be read at once
+	{
+		high = TMR1H;
+		low = TMR1L;
+	} while (high != TMR1H);
+	return ((uint16_t)high << 8) | low;
+}
+
+void perf_record(struct perf_counter* counter, uint16_t elapsed)
+{
+	if (counter->count == 0xFFFF)
+		return; // the average would no longer be exact
+	if (counter->count == 0 || elapsed < counter->min)
+		counter->min = elapsed;
+	if (elapsed > counter->max)
+		counter->max = elapsed;
+	counter->sum += elapsed;
+	counter->count++;
+}
+#endif
+static uint8_t current_range = 0; // 0-2, as set by the range relays
+static uint8_t relay_switching = 0; // the new range relay is made, the old one not yet broken
+static uint32_t relay_switch_tick = 0; // tick at which the ongoing relay transition started
+static uint8_t conversion_invalid = 0; // the running conversion overlaps a relay transition
+static uint8_t streaming_enabled = 0;
+static struct stream_sample stream_ring[STREAM_RING_SIZE]; // samples waiting to be sent, oldest at stream_ring_head
+static uint8_t stream_ring_head;
+static uint8_t stream_ring_count;
+static uint8_t stream_overflows; // number of samples dropped because the ring buffer was full (wraps around)
+static uint8_t stream_frame_counter;
+static uint16_t stream_latency = STREAM_DEFAULT_LATENCY; // maximum time a sample may wait in a partially filled frame (ms)
+static uint16_t acquisition_period = 90; // time between the starts of two streamed conversions (ms)
+static uint32_t next_acquisition; // tick at which the next streamed conversion is due
+static uint32_t conversion_started; // tick at which the running conversion was started
+static uint8_t conversion_running;
+static uint8_t conversion_discard; // set if the running conversion was not started on a tick
+static uint8_t decimation = 1; // number of conversions averaged into each streamed sample
+static uint8_t decimation_count = 0; // number of conversions in the block being averaged
+static int32_t decimation_sum[2]; // potential and current summed over the block
+static uint8_t decimation_flags; // stream flags of the conversions in the block
+static uint32_t decimation_tick; // tick at which the first conversion in the block was started
+static volatile uint32_t tick_count; // incremented by the Timer2 interrupt every ms
+static uint8_t sweep_running = 0;
+static uint32_t sweep_position; // DAC code currently applied by the sweep (20 bits)
+static uint32_t sweep_target; // DAC code at the end of the current leg of the sweep
+static uint32_t sweep_vertex[2]; // DAC codes at which the sweep reverses, in the order they are reached
+static uint32_t sweep_stop; // DAC code at the end of the last leg
+static uint32_t sweep_step; // DAC step size (counts)
+static uint16_t sweep_period; // time between two DAC steps (ms)
+static uint16_t sweep_legs_left; // number of legs after the current one
+static uint32_t next_sweep_step; // tick at which the next DAC step is due
+static uint8_t wave_fifo[WAVE_FIFO_SIZE][3]; // DAC codes (DAC format) waiting to be played back, oldest at wave_fifo_head
+static uint8_t wave_fifo_head;
+static uint8_t wave_fifo_count;
+static uint8_t wave_running = 0;
+static uint32_t wave_codes_left; // number of codes still to be played back
+static uint16_t wave_period; // time between two codes (ms)
+static uint32_t next_wave_step; // tick at which the next code is due
+static uint8_t wave_underruns; // number of steps at which the FIFO was empty (wraps around)
+static uint8_t dac_cal_running = 0;
+static uint32_t dac_cal_started; // tick at which the DAC self-calibration was started
+static uint8_t cd_running = 0;
+static struct cd_phase cd_phases[2];
+static uint8_t cd_phase; // index of the phase in progress
+static uint16_t cd_half_cycles_left;
+static uint8_t cd_idle_dac[3]; // DAC setpoint applied after the last half cycle
+static uint8_t cd_cell_off_when_done;
+static uint8_t autorange_mask = 0; // bit n set if the autoranging may switch to range n (0-2); 0 disables it
+static int32_t autorange_offset; // raw current ADC value at zero current
+static int32_t autorange_upper[3]; // raw current magnitude above which a less sensitive range is needed
+static int32_t autorange_lower[3]; // raw current magnitude below which a more sensitive range can be used
+static uint8_t autorange_count; // number of consecutive detections needed for a switch
+static uint8_t autorange_over, autorange_under;
+static uint8_t delay_pending = 0; // a DELAY is running; the command packet and the reply stay in the EP1 buffers until it ends
+static uint32_t delay_end; // tick at which the pending DELAY ends
+static const uint8_t* batch_next = NULL; // next command of the batch suspended by the pending DELAY, or NULL
+static uint8_t* batch_reply; // start of the reply of the batch being executed
+static uint8_t batch_reply_length;
+
+uint8_t crc8(const uint8_t* data, uint8_t length)
+{
+	// CRC-8 with polynomial x^8 + x^2 + x + 1
+	uint8_t crc = 0;
+	uint8_t i;
+	while (length-- > 0)
+	{
+		crc ^= *data++;
+		for (i = 0; i < 8; i++)
+			crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+	}
+	return crc;
+}
+
+unsigned cal_slot_address(uint8_t slot)
+{
+	// records never straddle two rows, so each one can be written without touching the others
+	return HEFLASH_START + (unsigned)(CAL_LOG_FIRST_ROW + slot / CAL_RECORDS_PER_ROW) * FLASH_ROWSIZE + (slot % CAL_RECORDS_PER_ROW) * CAL_RECORD_LENGTH;
+}
+
+uint8_t cal_slot_erased(uint8_t slot)
+{
+	return FLASH_read(cal_slot_address(slot)) == FLASH_ERASED;
+}
+
+uint8_t cal_read_record(uint8_t slot, uint8_t* record)
+{
+	// returns 1 if the slot holds a complete record of the current format with a correct CRC
+	unsigned address = cal_slot_address(slot);
+	unsigned word;
+	uint8_t i;
+	for (i = 0; i < CAL_RECORD_LENGTH; i++)
+	{
+		word = FLASH_read(address + i);
+		if (word > 0xFF)
+			return 0; // erased
+		record[i] = word;
+	}
+	return (record[0] >> 4) == CAL_RECORD_VERSION && (record[0] & 0x0F) < CAL_BLOCKS && crc8(record, CAL_RECORD_LENGTH - 1) == record[CAL_RECORD_LENGTH - 1];
+}
+
+void cal_write_record(uint8_t slot, uint8_t block)
+{
+	// programs only the latches of this record; the other latches keep their erased value, which leaves the rest of the row unchanged
+	uint8_t record[CAL_RECORD_LENGTH];
+	unsigned address = cal_slot_address(slot);
+	uint8_t i;
+	record[0] = (CAL_RECORD_VERSION << 4) | block;
+	record[1] = ++cal_sequence;
+	memcpy(record + 2, calibration_blocks[block], CALIBRATION_LENGTH);
+	record[CAL_RECORD_LENGTH - 1] = crc8(record, CAL_RECORD_LENGTH - 1);
+	for (i = 0; i < CAL_RECORD_LENGTH - 1; i++)
+		FLASH_write(address + i, record[i], 1); // latch
+	FLASH_write(address + i, record[i], 0); // write the row
+	cal_block_slot[block] = slot;
+	cal_log_head = slot;
+}
+
+uint8_t cal_row_erased(uint8_t row)
+{
+	uint8_t slot;
+	for (slot = row * CAL_RECORDS_PER_ROW; slot < (row + 1) * CAL_RECORDS_PER_ROW; slot++)
+		if (!cal_slot_erased(slot))
+			return 0;
+	return 1;
+}
+
+void cal_erase_row(uint8_t row)
+{
+	FLASH_erase(HEFLASH_START + (unsigned)(CAL_LOG_FIRST_ROW + row) * FLASH_ROWSIZE);
+}
+
+uint8_t cal_copy_row(uint8_t slot, uint8_t row, uint8_t block)
+{
+	// write the latest records of the blocks other than the one being saved that live in row, from slot on; returns the next free slot
+	uint8_t i;
+	for (i = 0; i < CAL_BLOCKS; i++)
+		if (i != block && cal_block_slot[i] != CAL_SLOT_NONE && cal_block_slot[i] / CAL_RECORDS_PER_ROW == row)
+			cal_write_record(slot++, i);
+	return slot;
+}
+
+uint8_t cal_start_row(uint8_t slot, uint8_t block, uint8_t next_row)
+{
+	// the row after the one being filled is kept erased, so an erase never destroys the only copy of a live
+	// record: the latest records of the other blocks in next_row are copied into the started row, after which
+	// next_row only holds superseded records once the block being saved is written. Returns the first free slot.
+	uint8_t row = slot / CAL_RECORDS_PER_ROW;
+	if (!cal_row_erased(row))
+	{
+		// only in a log written by firmware that kept no spare row; its live records are rewritten right away
+		cal_erase_row(row);
+		slot = cal_copy_row(slot, row, block);
+	}
+	return cal_copy_row(slot, next_row, block); // at most CAL_BLOCKS - 1 records in all, so the row has room for the block being saved
+}
+
+void cal_append(uint8_t block)
+{
+	// append a record of the block's value in RAM after the latest one; rows are erased one ahead of the head (see cal_start_row())
+	uint8_t slot = (cal_log_head == CAL_SLOT_NONE) ? 0 : cal_log_head + 1;
+	uint8_t next_row;
+	if (slot == CAL_LOG_SLOTS)
+		slot = 0;
+	if (!cal_slot_erased(slot) && slot % CAL_RECORDS_PER_ROW != 0)
+	{
+		slot += CAL_RECORDS_PER_ROW - slot % CAL_RECORDS_PER_ROW; // the rest of this row is unusable, so continue in the next one
+		if (slot == CAL_LOG_SLOTS)
+			slot = 0;
+	}
+	if (slot % CAL_RECORDS_PER_ROW != 0)
+	{
+		cal_write_record(slot, block);
+		return;
+	}
+	next_row = slot / CAL_RECORDS_PER_ROW + 1;
+	if (next_row == CAL_LOG_ROWS)
+		next_row = 0;
+	slot = cal_start_row(slot, block, next_row);
+	cal_write_record(slot, block);
+	if (!cal_row_erased(next_row))
+		cal_erase_row(next_row); // becomes the spare row
+}
+
+void cal_save(uint8_t block, const uint8_t* data)
+{
+	memcpy(calibration_blocks[block], data, CALIBRATION_LENGTH);
+	cal_append(block);
+}
+
+void cal_migrate()
+{
+	// older firmware kept the offset, DAC calibration and shunt calibration at the start of rows 1, 2 and 3;
+	// such blocks are moved into a freshly erased log
+	uint8_t saved = 0;
+	uint8_t block, i;
+	unsigned address;
+	for (block = 0; block < CAL_BLOCKS; block++)
+	{
+		address = HEFLASH_START + (unsigned)(CAL_LOG_FIRST_ROW + block) * FLASH_ROWSIZE;
+		if (FLASH_read(address) == FLASH_ERASED)
+			continue; // never saved
+		for (i = 0; i < CALIBRATION_LENGTH; i++)
+			calibration_blocks[block][i] = FLASH_read(address + i);
+		saved |= 1 << block;
+	}
+	if (!saved)
+		return;
+	for (i = 0; i < CAL_LOG_ROWS; i++)
+		FLASH_erase(HEFLASH_START + (unsigned)(CAL_LOG_FIRST_ROW + i) * FLASH_ROWSIZE);
+	for (block = 0; block < CAL_BLOCKS; block++)
+		if (saved & (1 << block))
+			cal_append(block);
+}
+
+void cal_load()
+{
+	// find the latest valid record of each block; sequence numbers are compared modulo 256,
+	// which is safe because the log holds far fewer records than that
+	uint8_t record[CAL_RECORD_LENGTH];
+	uint8_t block_sequence[CAL_BLOCKS];
+	uint8_t slot, block;
+	memset(calibration_blocks, 0xFF, sizeof(calibration_blocks)); // reads as "never saved", like erased flash
+	memset(cal_block_slot, CAL_SLOT_NONE, sizeof(cal_block_slot));
+	for (slot = 0; slot < CAL_LOG_SLOTS; slot++)
+	{
+		if (!cal_read_record(slot, record))
+			continue;
+		block = record[0] & 0x0F;
+		if (cal_block_slot[block] == CAL_SLOT_NONE || (int8_t)(record[1] - block_sequence[block]) > 0)
+		{
+			memcpy(calibration_blocks[block], record + 2, CALIBRATION_LENGTH);
+			cal_block_slot[block] = slot;
+			block_sequence[block] = record[1];
+		}
+		if (cal_log_head == CAL_SLOT_NONE || (int8_t)(record[1] - cal_sequence) > 0)
+		{
+			cal_log_head = slot;
+			cal_sequence = record[1];
+		}
+	}
+	if (cal_log_head == CAL_SLOT_NONE)
+		cal_migrate();
+}
 
 void InitializeIO()
 {
+	uint8_t serial[SERIAL_NUMBER_LENGTH]; // copied into the RAM string descriptor, so it need not be kept
 	OSCCONbits.IRCF = 0b1111; // 0b1111 = 16MHz HFINTOSC postscaler
 	ANSELA = 0x00; // digital I/O on PORTA
 	ANSELB = 0x00; // digital I/O on PORTB
@@ -88,14 +461,35 @@ void InitializeIO()
 	RANGE1_PIN = 1; // initialize range to range 1
 	RANGE2_PIN = 0;
 	RANGE3_PIN = 0;
+	T2CONbits.T2CKPS = 0b10; // Timer2 prescaler 1:16, 12 MHz/16 = 750 kHz
+	PR2 = 249; // 750 kHz/250 = 3 kHz
+	T2CONbits.T2OUTPS = 0b0010; // postscaler 1:3, giving a 1 ms tick
+	PIE1bits.TMR2IE = 1;
+	T2CONbits.TMR2ON = 1;
+#ifdef PERF_STATS
+	T1CONbits.TMR1CS = 0b00; // Timer1 clocked at Fosc/4 = 12 MHz
+	T1CONbits.T1CKPS = 0b10; // prescaler 1:4, giving 3 MHz
+	T1CONbits.TMR1ON = 1;
+#endif
 	InitializeSPI();
 	__delay_ms(25); // power-up delay - necessary for DAC1220
 	DAC1220_Reset();
 	__delay_ms(25);
 	DAC1220_Init();
-	HEFLASH_readBlock(heflashbuffer, 2, FLASH_ROWSIZE); // get dac calibration
-	DAC1220_Write3Bytes(8, heflashbuffer[0], heflashbuffer[1], heflashbuffer[2]); // apply dac calibration
-	DAC1220_Write3Bytes(12, heflashbuffer[3], heflashbuffer[4], heflashbuffer[5]); 
+	cal_load(); // get the calibration values from the HEFLASH log
+	DAC1220_Write3Bytes(8, calibration_blocks[CAL_BLOCK_DAC][0], calibration_blocks[CAL_BLOCK_DAC][1], calibration_blocks[CAL_BLOCK_DAC][2]); // apply dac calibration
+	DAC1220_Write3Bytes(12, calibration_blocks[CAL_BLOCK_DAC][3], calibration_blocks[CAL_BLOCK_DAC][4], calibration_blocks[CAL_BLOCK_DAC][5]);
+	HEFLASH_readBlock(serial, SERIAL_NUMBER_ROW, SERIAL_NUMBER_LENGTH);
+	usb_set_serial_number(serial); // must be set before the host enumerates the device
+}
+
+uint32_t ticks()
+{
+	uint32_t t;
+	PIE1bits.TMR2IE = 0; // the tick count cannot be read atomically
+	t = tick_count;
+	PIE1bits.TMR2IE = 1;
+	return t;
 }
 
 void command_unknown()
@@ -112,166 +506,886 @@ void send_OK()
     transmit_data_length = strlen(reply);
 }
 
-void command_cell_on()
+void send_BUSY()
+{
+	const uint8_t* reply = "BUSY";
+    strcpy(transmit_data, reply);
+    transmit_data_length = strlen(reply);
+}
+
+uint8_t dac_cal_busy()
+{
+	// nothing may write to the DAC1220 during its self-calibration; commands that would reply "BUSY" instead
+	if (!dac_cal_running)
+		return 0;
+	send_BUSY();
+	return 1;
+}
+
+void command_cell_on(const uint8_t* args)
 {
 	CELL_ON_PIN = CELL_ON;
 	send_OK();
 }
 
-void command_cell_off()
+void command_cell_off(const uint8_t* args)
 {
 	CELL_ON_PIN = CELL_OFF;
 	send_OK();
 }
 
-void command_mode_potentiostatic()
+void command_mode_potentiostatic(const uint8_t* args)
 {
 	MODE_SW_PIN = POTENTIOSTATIC;
 	send_OK();
 }
 
-void command_mode_galvanostatic()
+void command_mode_galvanostatic(const uint8_t* args)
 {
 	MODE_SW_PIN = GALVANOSTATIC;
 	send_OK();
 }
 
-void command_range1()
+void set_current_range(uint8_t range)
+{
+    if (range == current_range || range > 2)
+        return;
+    if (range == 0)
+        RANGE1_PIN = 1;
+    else if (range == 1)
+        RANGE2_PIN = 1;
+    else
+        RANGE3_PIN = 1;
+    current_range = range;
+    relay_switching = 1; // make the new relay setting now, and break the old one in relay_service()
+    relay_switch_tick = ticks();
+    conversion_invalid = 1;
+}
+
+void relay_service()
+{
+    if (relay_switching && ticks() - relay_switch_tick >= RELAY_MAKE_TIME)
+    {
+        RANGE1_PIN = (current_range == 0);
+        RANGE2_PIN = (current_range == 1);
+        RANGE3_PIN = (current_range == 2);
+        relay_switching = 0;
+        conversion_invalid = 1; // a conversion started before this moment is flagged invalid
+    }
+}
+
+void command_range1(const uint8_t* args)
 {
-    RANGE1_PIN = 1;
-    __delay_ms(10); // make the new relay setting before breaking the old one
-    RANGE2_PIN = 0;
-    RANGE3_PIN = 0;
+	set_current_range(0);
 	send_OK();
 }
 
-void command_range2()
+void command_range2(const uint8_t* args)
 {
-    RANGE2_PIN = 1;
-    __delay_ms(10); // make the new relay setting before breaking the old one
-    RANGE1_PIN = 0;
-    RANGE3_PIN = 0;
+	set_current_range(1);
 	send_OK();
 }
 
-void command_range3()
+void command_range3(const uint8_t* args)
 {
-    RANGE3_PIN = 1;
-    __delay_ms(10); // make the new relay setting before breaking the old one
-    RANGE1_PIN = 0;
-    RANGE2_PIN = 0;
+	set_current_range(2);
 	send_OK();
 }
 
 void command_set_dac(const uint8_t* dac_data)
 {
-	DAC1220_Write3Bytes(0, dac_data[0], dac_data[1], dac_data[2]);
+	if (dac_cal_busy())
+		return;
+	PERF_MEASURE(&perf_counters[PERF_DAC_WRITE], DAC1220_Write3Bytes(0, dac_data[0], dac_data[1], dac_data[2]));
+	send_OK();
+}
+
+uint32_t dac_bytes_to_code(const uint8_t* dac_data)
+{
+	return ((uint32_t)dac_data[0] << 12) | ((uint16_t)dac_data[1] << 4) | (dac_data[2] >> 4); // see DAC1220 datasheet (20-bit mode)
+}
+
+void dac_write_code(uint32_t code)
+{
+	PERF_MEASURE(&perf_counters[PERF_DAC_WRITE], DAC1220_Write3Bytes(0, code >> 12, code >> 4, code << 4));
+}
+
+void command_cv_sweep(const uint8_t* sweep_data)
+{
+	// sweep_data: start, first vertex, second vertex, stop (3 bytes each, DAC format), step (3 bytes, DAC format), step period (2 bytes), number of cycles (2 bytes)
+	if (dac_cal_busy())
+		return;
+	sweep_position = dac_bytes_to_code(sweep_data);
+	sweep_vertex[0] = dac_bytes_to_code(sweep_data+3);
+	sweep_vertex[1] = dac_bytes_to_code(sweep_data+6);
+	sweep_stop = dac_bytes_to_code(sweep_data+9);
+	sweep_step = dac_bytes_to_code(sweep_data+12);
+	sweep_period = ((uint16_t)sweep_data[15] << 8) | sweep_data[16];
+	sweep_legs_left = 2 * (((uint16_t)sweep_data[17] << 8) | sweep_data[18]) + 1; // each cycle goes to the second vertex and back, followed by a leg to the stop potential
+	sweep_target = sweep_vertex[0];
+	if (sweep_step == 0)
+		sweep_step = 1;
+	dac_write_code(sweep_position);
+	next_sweep_step = ticks() + sweep_period;
+	wave_running = 0; // the sweep and the waveform playback both drive the DAC
+	sweep_running = 1;
+	send_OK();
+}
+
+void command_cv_stop(const uint8_t* args)
+{
+	sweep_running = 0; // the DAC keeps its last value
+	send_OK();
+}
+
+void sweep_service()
+{
+	if (!sweep_running || (int32_t)(ticks() - next_sweep_step) < 0)
+		return;
+	next_sweep_step += sweep_period;
+	if (sweep_position == sweep_target) // end of a leg
+	{
+		if (sweep_legs_left == 0)
+		{
+			sweep_running = 0; // sweep finished
+			return;
+		}
+		sweep_legs_left--;
+		if (sweep_legs_left == 0)
+			sweep_target = sweep_stop;
+		else
+			sweep_target = (sweep_target == sweep_vertex[0]) ? sweep_vertex[1] : sweep_vertex[0];
+	}
+	if (sweep_target > sweep_position)
+		sweep_position = (sweep_target - sweep_position > sweep_step) ? sweep_position + sweep_step : sweep_target;
+	else
+		sweep_position = (sweep_position - sweep_target > sweep_step) ? sweep_position - sweep_step : sweep_target;
+	dac_write_code(sweep_position);
+}
+
+void command_wave_data(const uint8_t* wave_data)
+{
+	// wave_data: number of codes (up to WAVE_CHUNK_CODES), followed by WAVE_CHUNK_CODES codes (3 bytes each, DAC format)
+	// reply: number of codes accepted, free FIFO slots left; codes that do not fit are dropped and must be resent
+	uint8_t count = wave_data[0];
+	uint8_t accepted;
+	uint8_t i;
+	if (count > WAVE_CHUNK_CODES)
+		count = WAVE_CHUNK_CODES;
+	for (accepted = 0; accepted < count && wave_fifo_count < WAVE_FIFO_SIZE; accepted++)
+	{
+		i = wave_fifo_head + wave_fifo_count;
+		if (i >= WAVE_FIFO_SIZE)
+			i -= WAVE_FIFO_SIZE;
+		memcpy(wave_fifo[i], wave_data + 1 + 3*accepted, 3);
+		wave_fifo_count++;
+	}
+	transmit_data[0] = accepted;
+	transmit_data[1] = WAVE_FIFO_SIZE - wave_fifo_count;
+	transmit_data_length = 2;
+}
+
+void command_wave_start(const uint8_t* wave_data)
+{
+	// wave_data: time between two codes (2 bytes, ms), total number of codes to play back (4 bytes)
+	// the FIFO should be filled beforehand; the first code is applied on the next tick
+	if (dac_cal_busy())
+		return;
+	wave_period = ((uint16_t)wave_data[0] << 8) | wave_data[1];
+	if (wave_period == 0)
+		wave_period = 1; // one tick is the shortest period
+	wave_codes_left = ((uint32_t)wave_data[2] << 24) | ((uint32_t)wave_data[3] << 16) | ((uint16_t)wave_data[4] << 8) | wave_data[5];
+	wave_underruns = 0;
+	next_wave_step = ticks() + 1;
+	sweep_running = 0; // the sweep and the waveform playback both drive the DAC
+	wave_running = (wave_codes_left > 0);
+	send_OK();
+}
+
+void command_wave_stop(const uint8_t* args)
+{
+	wave_running = 0; // the DAC keeps its last value
+	wave_fifo_head = 0; // codes not yet played back are discarded
+	wave_fifo_count = 0;
 	send_OK();
 }
 
-void command_calibrate_dac()
+void command_wave_status(const uint8_t* args)
+{
+	// reply: free FIFO slots, underrun counter, number of codes still to be played back (4 bytes)
+	transmit_data[0] = WAVE_FIFO_SIZE - wave_fifo_count;
+	transmit_data[1] = wave_underruns;
+	transmit_data[2] = wave_codes_left >> 24;
+	transmit_data[3] = wave_codes_left >> 16;
+	transmit_data[4] = wave_codes_left >> 8;
+	transmit_data[5] = wave_codes_left;
+	transmit_data_length = 6;
+}
+
+void wave_service()
 {
+	const uint8_t* code;
+	if (!wave_running || (int32_t)(ticks() - next_wave_step) < 0)
+		return;
+	next_wave_step += wave_period;
+	if (wave_fifo_count == 0)
+	{
+		wave_underruns++; // the DAC holds its value; the rest of the waveform is delayed by one period
+		return;
+	}
+	code = wave_fifo[wave_fifo_head];
+	PERF_MEASURE(&perf_counters[PERF_DAC_WRITE], DAC1220_Write3Bytes(0, code[0], code[1], code[2]));
+	if (++wave_fifo_head == WAVE_FIFO_SIZE)
+		wave_fifo_head = 0;
+	wave_fifo_count--;
+	if (--wave_codes_left == 0)
+		wave_running = 0; // waveform finished
+}
+
+void command_calibrate_dac(const uint8_t* args)
+{
+	// the calibration finishes in the background (see dac_cal_service()), so USB keeps being served; "CALSTATUS" tells when it is done.
+	// It is refused while anything else drives the DAC, rather than stopping that behind the host's back.
+	if (dac_cal_running || sweep_running || wave_running || cd_running)
+	{
+		send_BUSY();
+		return;
+	}
 	DAC1220_SelfCal();
-	__delay_ms(500); // wait until calibration is finished
-	uint8_t data[6];
+	dac_cal_started = ticks();
+	dac_cal_running = 1;
+	send_OK();
+}
+
+void dac_cal_service()
+{
+	uint8_t data[CALIBRATION_LENGTH];
+	if (!dac_cal_running || ticks() - dac_cal_started < DAC_SELFCAL_TIME)
+		return;
 	DAC1220_Read3Bytes(8, data, data+1, data+2); // get calibration data
 	DAC1220_Read3Bytes(12, data+3, data+4, data+5);
-	HEFLASH_writeBlock(2, data, 6); // save calibration data to HEFLASH
-	send_OK();
+	cal_save(CAL_BLOCK_DAC, data); // save calibration data to HEFLASH
+	dac_cal_running = 0;
 }
 
-void command_read_adc()
+void command_cal_status(const uint8_t* args)
+{
+	// reply: "WAIT" while a DAC self-calibration is running, "OK" once its result has been saved (or if none was started)
+	if (dac_cal_running)
+	{
+		const uint8_t* reply = "WAIT";
+		PERF_EVENT(wait_replies);
+		strcpy(transmit_data, reply);
+		transmit_data_length = strlen(reply);
+	}
+	else
+		send_OK();
+}
+
+void command_read_adc(const uint8_t* args)
 {
 	uint8_t adc_data[6];
+	if (streaming_enabled || cd_running)
+	{
+		send_BUSY(); // stream_service() owns the ADC; a polled read would start or consume its conversion
+		return;
+	}
+	PERF_BEGIN(adc_start);
 	if(MCP3550_Read(adc_data))
 	{
+		PERF_END(adc_start, &perf_counters[PERF_ADC_READ]);
 		transmit_data_length=6;
 		memcpy(transmit_data, adc_data, transmit_data_length);
 	}
 	else
 	{
 		const uint8_t* reply = "WAIT";
+		PERF_EVENT(wait_replies);
 		strcpy(transmit_data, reply);
 		transmit_data_length = strlen(reply);
 	}
 }
 
-void command_read_offset()
+void acquisition_start()
+{
+	conversion_running = 1; // a conversion may still be running from polled mode...
+	conversion_discard = 1; // ...so wait for it and drop the result
+	next_acquisition = ticks();
+}
+
+void command_stream_start(const uint8_t* args)
+{
+	stream_frame_counter = 0;
+	stream_ring_head = 0; // start with an empty ring buffer
+	stream_ring_count = 0;
+	stream_overflows = 0;
+	stream_latency = STREAM_DEFAULT_LATENCY;
+	decimation = 1;
+	decimation_count = 0;
+	if (!cd_running)
+		acquisition_start();
+	streaming_enabled = 1;
+	send_OK();
+}
+
+void command_stream_stop(const uint8_t* args)
+{
+	streaming_enabled = 0;
+	send_OK();
+}
+
+void command_stream_latency(const uint8_t* latency_data)
+{
+	stream_latency = ((uint16_t)latency_data[0] << 8) | latency_data[1];
+	send_OK();
+}
+
+void command_stream_period(const uint8_t* period_data)
+{
+	acquisition_period = ((uint16_t)period_data[0] << 8) | period_data[1];
+	if (acquisition_period == 0)
+		acquisition_period = 1; // one tick is the shortest period
+	send_OK();
+}
+
+uint8_t stream_flags()
+{
+	uint8_t flags = current_range;
+	if (conversion_invalid)
+		flags |= STREAM_FLAG_INVALID;
+	if (MODE_SW_PIN == GALVANOSTATIC)
+		flags |= STREAM_FLAG_GALVANOSTATIC;
+	if (CELL_ON_PIN == CELL_ON)
+		flags |= STREAM_FLAG_CELL_ON;
+	if (sweep_running || wave_running)
+		flags |= STREAM_FLAG_SWEEP;
+	if (cd_running)
+	{
+		flags |= STREAM_FLAG_CD;
+		if (cd_phase)
+			flags |= STREAM_FLAG_CD_PHASE;
+	}
+	return flags;
+}
+
+int32_t mcp3550_to_int32(const uint8_t* adc_data)
+{
+	// 22-bit two's complement value, extended by the overflow bits (see MCP3550 datasheet)
+	int32_t value = ((uint32_t)(adc_data[0] & 0x3F) << 16) | ((uint16_t)adc_data[1] << 8) | adc_data[2];
+	if ((adc_data[0] & 0x80) || ((adc_data[0] & 0x60) == 0x20)) // overflow low, or negative without overflow
+		value -= 0x400000;
+	return value;
+}
+
+int32_t int24_to_int32(const uint8_t* data)
+{
+	int32_t value = ((uint32_t)data[0] << 16) | ((uint16_t)data[1] << 8) | data[2];
+	if (data[0] & 0x80)
+		value -= 0x1000000; // sign extension
+	return value;
+}
+
+void command_cd_start(const uint8_t* cd_data)
+{
+	// cd_data: for each of the two phases, DAC setpoint (3 bytes), current range (1 byte), raw potential limit (3 bytes, signed)
+	// and limit direction (1 byte); then number of half cycles (2 bytes), final DAC setpoint (3 bytes), cell off when done (1 byte)
+	uint8_t i;
+	if (dac_cal_busy())
+		return;
+	if (cd_data[3] > 2 || cd_data[11] > 2) // the ranges index the range tables and end up in the frame flags
+	{
+		command_unknown();
+		return;
+	}
+	for (i = 0; i < 2; i++, cd_data += 8)
+	{
+		memcpy(cd_phases[i].dac, cd_data, 3);
+		cd_phases[i].range = cd_data[3];
+		cd_phases[i].limit = int24_to_int32(cd_data+4);
+		cd_phases[i].rising = cd_data[7];
+	}
+	cd_half_cycles_left = ((uint16_t)cd_data[0] << 8) | cd_data[1];
+	memcpy(cd_idle_dac, cd_data+2, 3);
+	cd_cell_off_when_done = cd_data[5];
+	cd_phase = 0; // the host has already applied the setpoint of the first phase
+	if (!streaming_enabled && !cd_running)
+		acquisition_start(); // the limits are checked on every streamed conversion, whether or not they reach the host
+	cd_running = (cd_half_cycles_left > 0);
+	send_OK();
+}
+
+void command_cd_stop(const uint8_t* args)
+{
+	cd_running = 0; // the DAC and cell keep their state
+	send_OK();
+}
+
+void cd_service(const uint8_t* adc_data)
+{
+	int32_t potential;
+	if (!cd_running)
+		return;
+	potential = mcp3550_to_int32(adc_data);
+	if (cd_phases[cd_phase].rising ? potential <= cd_phases[cd_phase].limit : potential >= cd_phases[cd_phase].limit)
+		return; // limit not crossed
+	if (--cd_half_cycles_left == 0)
+	{
+		PERF_MEASURE(&perf_counters[PERF_DAC_WRITE], DAC1220_Write3Bytes(0, cd_idle_dac[0], cd_idle_dac[1], cd_idle_dac[2]));
+		if (cd_cell_off_when_done)
+			CELL_ON_PIN = CELL_OFF;
+		cd_running = 0;
+		return;
+	}
+	cd_phase ^= 1;
+	set_current_range(cd_phases[cd_phase].range);
+	PERF_MEASURE(&perf_counters[PERF_DAC_WRITE], DAC1220_Write3Bytes(0, cd_phases[cd_phase].dac[0], cd_phases[cd_phase].dac[1], cd_phases[cd_phase].dac[2]));
+}
+
+void command_autorange(const uint8_t* autorange_data)
+{
+	// autorange_data: mask of usable ranges (1 byte), current offset (3 bytes, signed), upper and lower threshold
+	// for each range (3 bytes each, relative to the offset), number of detections needed for a switch (1 byte)
+	uint8_t i;
+	autorange_mask = autorange_data[0];
+	autorange_offset = int24_to_int32(autorange_data+1);
+	for (i = 0; i < 3; i++)
+	{
+		autorange_upper[i] = int24_to_int32(autorange_data+4+6*i);
+		autorange_lower[i] = int24_to_int32(autorange_data+7+6*i);
+	}
+	autorange_count = autorange_data[22];
+	autorange_over = 0;
+	autorange_under = 0;
+	send_OK();
+}
+
+void autorange_service(const uint8_t* adc_data)
+{
+	int32_t current;
+	// in galvanostatic mode, the range sets the applied current, so it is left alone
+	if (!autorange_mask || MODE_SW_PIN == GALVANOSTATIC || cd_running || conversion_invalid)
+		return;
+	current = mcp3550_to_int32(adc_data+3) - autorange_offset;
+	if (current < 0)
+		current = -current;
+	if (current > autorange_upper[current_range] && current_range != 0 && (autorange_mask & (1 << (current_range-1))))
+		autorange_over++;
+	else
+		autorange_over = 0;
+	if (current < autorange_lower[current_range] && current_range != 2 && (autorange_mask & (1 << (current_range+1))))
+		autorange_under++;
+	else
+		autorange_under = 0;
+	if (autorange_over > autorange_count)
+	{
+		set_current_range(current_range-1);
+		autorange_over = 0;
+	}
+	else if (autorange_under > autorange_count)
+	{
+		set_current_range(current_range+1);
+		autorange_under = 0;
+	}
+}
+
+uint8_t stream_run_length()
+{
+	// a frame only holds samples with identical flags and decimation taken in consecutive acquisition
+	// slots, so the host can reconstruct each sample's tick from the first one and the period
+	const struct stream_sample* first = &stream_ring[stream_ring_head];
+	const struct stream_sample* sample = first;
+	uint32_t tick = first->tick;
+	uint8_t length = 0;
+	while (length < stream_ring_count && length < STREAM_MAX_SAMPLES && sample->flags == first->flags
+		&& sample->decimation == first->decimation && sample->tick == tick)
+	{
+		length++;
+		tick += (uint32_t)first->decimation*acquisition_period;
+		if (++sample == stream_ring + STREAM_RING_SIZE)
+			sample = stream_ring;
+	}
+	return length;
+}
+
+void stream_ship_frame(uint8_t count)
+{
+	// send the oldest count samples in the ring buffer as a single frame
+	const struct stream_sample* first = &stream_ring[stream_ring_head];
+	uint8_t* frame = usb_get_in_buffer(1);
+	uint8_t i;
+	frame[0] = STREAM_FRAME_MARKER;
+	frame[1] = stream_frame_counter++; // lets the host detect lost frames
+	frame[2] = count;
+	frame[3] = first->flags;
+	memcpy(frame+4, &first->tick, 4); // the PIC is little-endian
+	frame[8] = first->decimation;
+	frame[9] = stream_overflows; // lets the host detect samples dropped because the ring buffer was full
+	for (i = 0; i < count; i++)
+	{
+		memcpy(frame + STREAM_HEADER_LEN + i*STREAM_SAMPLE_LEN, stream_ring[stream_ring_head].data, STREAM_SAMPLE_LEN);
+		if (++stream_ring_head == STREAM_RING_SIZE)
+			stream_ring_head = 0;
+	}
+	stream_ring_count -= count;
+	usb_send_in_buffer(1, STREAM_HEADER_LEN + count*STREAM_SAMPLE_LEN);
+}
+
+void stream_store_sample(const uint8_t* adc_data, uint32_t tick, uint8_t flags)
+{
+	// samples wait in the ring buffer until EP1 IN is free, so short host stalls do not lose data
+	struct stream_sample* sample;
+	uint8_t i;
+	if (!streaming_enabled)
+		return;
+	if (stream_ring_count == STREAM_RING_SIZE)
+	{
+		stream_overflows++;
+		PERF_EVENT(dropped_samples);
+		return;
+	}
+	i = stream_ring_head + stream_ring_count;
+	if (i >= STREAM_RING_SIZE)
+		i -= STREAM_RING_SIZE;
+	sample = &stream_ring[i];
+	sample->tick = tick;
+	sample->flags = flags;
+	sample->decimation = decimation;
+	memcpy(sample->data, adc_data, STREAM_SAMPLE_LEN);
+	stream_ring_count++;
+}
+
+void int32_to_mcp3550(int32_t value, uint8_t* adc_data)
+{
+	// inverse of mcp3550_to_int32()
+	uint32_t code;
+	if (value >= 0x200000) // overflow high
+		code = 0x400000 | (value & 0x3FFFFF);
+	else if (value < -0x200000) // overflow low
+		code = 0x800000 | (value + 0x400000);
+	else
+		code = value & 0x3FFFFF;
+	adc_data[0] = code >> 16;
+	adc_data[1] = code >> 8;
+	adc_data[2] = code;
+}
+
+void command_decimation(const uint8_t* decimation_data)
+{
+	decimation = decimation_data[0] ? decimation_data[0] : 1;
+	decimation_count = 0;
+	send_OK();
+}
+
+void stream_decimate(const uint8_t* adc_data)
+{
+	// boxcar average of blocks of conversions; the block restarts if the range or mode changes
+	uint8_t flags = stream_flags();
+	uint8_t averaged_data[STREAM_SAMPLE_LEN];
+	if (decimation == 1)
+	{
+		stream_store_sample(adc_data, conversion_started, flags);
+		return;
+	}
+	if (decimation_count > 0 && flags != decimation_flags)
+		decimation_count = 0; // the partial block is dropped
+	if (decimation_count == 0)
+	{
+		decimation_flags = flags;
+		decimation_tick = conversion_started;
+		decimation_sum[0] = 0;
+		decimation_sum[1] = 0;
+	}
+	decimation_sum[0] += mcp3550_to_int32(adc_data);
+	decimation_sum[1] += mcp3550_to_int32(adc_data+3);
+	if (++decimation_count < decimation)
+		return;
+	decimation_count = 0;
+	int32_to_mcp3550(decimation_sum[0] / decimation, averaged_data);
+	int32_to_mcp3550(decimation_sum[1] / decimation, averaged_data+3);
+	stream_store_sample(averaged_data, decimation_tick, flags);
+}
+
+void stream_service()
 {
-	HEFLASH_readBlock(heflashbuffer, 1, FLASH_ROWSIZE);
-	transmit_data_length=6;
-	memcpy(transmit_data, heflashbuffer, transmit_data_length);
+	uint32_t now = ticks();
+	uint8_t adc_data[6];
+	uint8_t run_length;
+	// while a DELAY is pending, the EP1 IN buffer holds the partial reply, so the samples wait in the ring buffer
+	if (streaming_enabled && stream_ring_count > 0 && !delay_pending && !usb_in_endpoint_halted(1) && !usb_in_endpoint_busy(1))
+	{
+		run_length = stream_run_length();
+		// ship when the frame is full, cannot be extended any further, or its oldest sample has waited long enough
+		if (run_length == STREAM_MAX_SAMPLES || run_length < stream_ring_count || now - stream_ring[stream_ring_head].tick >= stream_latency)
+			stream_ship_frame(run_length);
+	}
+	if (!conversion_running)
+	{
+		if ((int32_t)(now - next_acquisition) < 0)
+			return; // next acquisition slot not reached yet
+		if (now - next_acquisition >= acquisition_period) // one or more acquisition slots were missed
+			next_acquisition += (now - next_acquisition) / acquisition_period * acquisition_period;
+		MCP3550_Start();
+		conversion_started = next_acquisition;
+		conversion_invalid = relay_switching;
+		next_acquisition += acquisition_period;
+		conversion_running = 1;
+	}
+	else
+	{
+		PERF_BEGIN(adc_start);
+		if (!MCP3550_ReadResult(adc_data))
+			return; // conversion not finished yet
+		PERF_END(adc_start, &perf_counters[PERF_ADC_READ]);
+		conversion_running = 0;
+		if (conversion_discard)
+		{
+			conversion_discard = 0;
+			return;
+		}
+		// conversions keep being taken while EP1 is busy, so the charge/discharge limits are
+		// checked even if the host stalls; the sample is stored before a phase switch changes the flags
+		stream_decimate(adc_data);
+		cd_service(adc_data);
+		autorange_service(adc_data);
+	}
+}
+
+void command_delay(const uint8_t* delay_data)
+{
+	// lets a batch wait between two of its commands, e.g. for the output to settle; the rest of the batch and
+	// the reply are held back until the delay has passed, while the main loop keeps running its services
+	uint16_t delay = ((uint16_t)delay_data[0] << 8) | delay_data[1]; // ms
+	if (delay > MAX_DELAY)
+	{
+		command_unknown();
+		return;
+	}
+	delay_end = ticks() + delay;
+	delay_pending = 1;
+	send_OK();
+}
+
+void command_read_offset(const uint8_t* args)
+{
+	memcpy(transmit_data, calibration_blocks[CAL_BLOCK_OFFSET], CALIBRATION_LENGTH); // kept in RAM, so no flash read is needed
+	transmit_data_length = CALIBRATION_LENGTH;
 }
 
 void command_save_offset(const uint8_t* offset_data)
 {
-	HEFLASH_writeBlock(1, offset_data, 6);
+	cal_save(CAL_BLOCK_OFFSET, offset_data);
 	send_OK();
 }
 
-void command_read_shuntcalibration()
+void command_read_shuntcalibration(const uint8_t* args)
 {
-	HEFLASH_readBlock(heflashbuffer, 3, FLASH_ROWSIZE);
-	transmit_data_length=6;
-	memcpy(transmit_data, heflashbuffer, transmit_data_length);
+	memcpy(transmit_data, calibration_blocks[CAL_BLOCK_SHUNT], CALIBRATION_LENGTH);
+	transmit_data_length = CALIBRATION_LENGTH;
 }
 
 void command_save_shuntcalibration(const uint8_t* shuntcalibration_data)
 {
-	HEFLASH_writeBlock(3, shuntcalibration_data, 6);
+	cal_save(CAL_BLOCK_SHUNT, shuntcalibration_data);
 	send_OK();
 }
 
-void command_read_dac_cal()
+void command_read_dac_cal(const uint8_t* args)
+{
+	memcpy(transmit_data, calibration_blocks[CAL_BLOCK_DAC], CALIBRATION_LENGTH);
+	transmit_data_length = CALIBRATION_LENGTH;
+}
+
+void command_read_calibration(const uint8_t* args)
 {
-	HEFLASH_readBlock(heflashbuffer, 2, FLASH_ROWSIZE);
-	transmit_data_length=6;
-	memcpy(transmit_data, heflashbuffer, transmit_data_length);
+	// reply: the offset, DAC calibration and shunt calibration blocks, as returned by OFFSETREAD, DACCALGET and SHUNTCALREAD
+	memcpy(transmit_data, calibration_blocks, CAL_BLOCKS*CALIBRATION_LENGTH);
+	transmit_data_length = CAL_BLOCKS*CALIBRATION_LENGTH;
 }
 
 void command_set_dac_cal(const uint8_t* dac_cal_data)
 {
-	HEFLASH_writeBlock(2, dac_cal_data, 6);
+	if (dac_cal_busy())
+		return;
+	cal_save(CAL_BLOCK_DAC, dac_cal_data);
 	DAC1220_Write3Bytes(8, dac_cal_data[0], dac_cal_data[1], dac_cal_data[2]);
 	DAC1220_Write3Bytes(12, dac_cal_data[3], dac_cal_data[4], dac_cal_data[5]);
 	send_OK();
 }
 
+void command_set_serial(const uint8_t* serial_data)
+{
+	// takes effect immediately, but the host may only see it after re-enumeration
+	HEFLASH_writeBlock(SERIAL_NUMBER_ROW, serial_data, SERIAL_NUMBER_LENGTH);
+	usb_set_serial_number(serial_data);
+	send_OK();
+}
+
+typedef void (*command_handler)(const uint8_t* args);
+
+#ifdef PERF_STATS
+void command_stats(const uint8_t* args); // defined after the command table, whose size it needs
+#endif
+
+struct command {
+	command_handler handler;
+	uint8_t payload_length; // number of bytes following the opcode or the ASCII name
+	const char* name; // ASCII name, kept for compatibility with older host software
+	uint8_t name_length;
+};
+
+// Binary commands consist of an opcode (COMMAND_OPCODE_BASE + index in this table)
+// followed by a fixed-length payload; the opcodes cannot collide with ASCII commands
+static const struct command commands[] = {
+	{command_cell_on, 0, "CELL ON", 7}, // 0x80
+	{command_cell_off, 0, "CELL OFF", 8}, // 0x81
+	{command_mode_potentiostatic, 0, "POTENTIOSTATIC", 14}, // 0x82
+	{command_mode_galvanostatic, 0, "GALVANOSTATIC", 13}, // 0x83
+	{command_range1, 0, "RANGE 1", 7}, // 0x84
+	{command_range2, 0, "RANGE 2", 7}, // 0x85
+	{command_range3, 0, "RANGE 3", 7}, // 0x86
+	{command_set_dac, 3, "DACSET ", 7}, // 0x87
+	{command_calibrate_dac, 0, "DACCAL", 6}, // 0x88
+	{command_read_adc, 0, "ADCREAD", 7}, // 0x89
+	{command_read_offset, 0, "OFFSETREAD", 10}, // 0x8A
+	{command_save_offset, 6, "OFFSETSAVE ", 11}, // 0x8B
+	{command_read_dac_cal, 0, "DACCALGET", 9}, // 0x8C
+	{command_set_dac_cal, 6, "DACCALSET ", 10}, // 0x8D
+	{command_read_shuntcalibration, 0, "SHUNTCALREAD", 12}, // 0x8E
+	{command_save_shuntcalibration, 6, "SHUNTCALSAVE ", 13}, // 0x8F
+	{command_stream_start, 0, "STREAM START", 12}, // 0x90
+	{command_stream_stop, 0, "STREAM STOP", 11}, // 0x91
+	{command_stream_latency, 2, "STREAM LATENCY ", 15}, // 0x92
+	{command_stream_period, 2, "STREAM PERIOD ", 14}, // 0x93
+	{command_cv_sweep, 19, "CVSWEEP ", 8}, // 0x94
+	{command_cv_stop, 0, "CVSTOP", 6}, // 0x95
+	{command_cd_start, 22, "CDSTART ", 8}, // 0x96
+	{command_cd_stop, 0, "CDSTOP", 6}, // 0x97
+	{command_delay, 2, "DELAY ", 6}, // 0x98
+	{command_autorange, 23, "AUTORANGE ", 10}, // 0x99
+	{command_decimation, 1, "DECIMATION ", 11}, // 0x9A
+	{command_set_serial, SERIAL_NUMBER_LENGTH, "SERIALSET ", 10}, // 0x9B
+	{command_wave_data, 1+3*WAVE_CHUNK_CODES, "WAVEDATA ", 9}, // 0x9C, too long for an ASCII packet
+	{command_wave_start, 6, "WAVESTART ", 10}, // 0x9D
+	{command_wave_stop, 0, "WAVESTOP", 8}, // 0x9E
+	{command_wave_status, 0, "WAVESTATUS", 10}, // 0x9F
+	{command_read_calibration, 0, "CALREAD", 7}, // 0xA0
+	{command_cal_status, 0, "CALSTATUS", 9}, // 0xA1
+#ifdef PERF_STATS
+	{command_stats, 1, "STATS ", 6}, // 0xA2, only in firmware built with "make STATS=1"
+#endif
+};
+
+#ifdef PERF_STATS
+void perf_reply_counter(const struct perf_counter* counter)
+{
+	// reply: number of measurements, minimum, maximum (2 bytes each), sum (4 bytes), all in Timer1 counts and MSB first
+	transmit_data[0] = counter->count >> 8;
+	transmit_data[1] = counter->count;
+	transmit_data[2] = counter->min >> 8;
+	transmit_data[3] = counter->min;
+	transmit_data[4] = counter->max >> 8;
+	transmit_data[5] = counter->max;
+	transmit_data[6] = counter->sum >> 24;
+	transmit_data[7] = counter->sum >> 16;
+	transmit_data[8] = counter->sum >> 8;
+	transmit_data[9] = counter->sum;
+	transmit_data_length = 10;
+}
+
+void command_stats(const uint8_t* args)
+{
+	// args: PERF_* counter index, a binary opcode to time that command in the PERF_COMMAND counter (which is cleared),
+	// PERF_STATS_EVENTS for the event counters, or PERF_STATS_RESET to clear all counters (the selected command is kept)
+	uint8_t index = args[0];
+	if (index < PERF_COUNTERS)
+		perf_reply_counter(&perf_counters[index]);
+	else if (index >= COMMAND_OPCODE_BASE && index - COMMAND_OPCODE_BASE < NUM_COMMANDS)
+	{
+		perf_command = index - COMMAND_OPCODE_BASE;
+		memset(&perf_counters[PERF_COMMAND], 0, sizeof(perf_counters[PERF_COMMAND]));
+		send_OK();
+	}
+	else if (index == PERF_STATS_EVENTS)
+	{
+		// reply: WAIT replies, EP1 busy passes, dropped samples (2 bytes each, MSB first), opcode of the timed command (0 if none)
+		transmit_data[0] = perf_events.wait_replies >> 8;
+		transmit_data[1] = perf_events.wait_replies;
+		transmit_data[2] = perf_events.ep1_busy >> 8;
+		transmit_data[3] = perf_events.ep1_busy;
+		transmit_data[4] = perf_events.dropped_samples >> 8;
+		transmit_data[5] = perf_events.dropped_samples;
+		transmit_data[6] = (perf_command == PERF_COMMAND_NONE) ? 0 : COMMAND_OPCODE_BASE + perf_command;
+		transmit_data_length = 7;
+	}
+	else if (index == PERF_STATS_RESET)
+	{
+		memset(perf_counters, 0, sizeof(perf_counters));
+		memset(&perf_events, 0, sizeof(perf_events));
+		send_OK();
+	}
+	else
+		command_unknown();
+}
+#endif
+
+void interpret_batch()
+{
+	// Execute the binary commands of the packet from batch_next on, one after the other; each reply is
+	// prefixed with its length, and the replies are returned together in a single packet. A DELAY
+	// suspends the batch, which the main loop resumes once the delay has passed.
+	const uint8_t* end = received_data + received_data_length;
+	uint8_t i;
+	while (batch_next < end && batch_reply_length + 1 + MAX_REPLY_LENGTH <= EP_1_IN_LEN)
+	{
+		i = batch_next[0] - COMMAND_OPCODE_BASE;
+		if (batch_next[0] < COMMAND_OPCODE_BASE || i >= NUM_COMMANDS || batch_next + 1 + commands[i].payload_length > end)
+			break; // malformed command; the host notices from the number of replies
+		transmit_data = batch_reply + batch_reply_length + 1;
+		PERF_MEASURE_COMMAND(i, commands[i].handler(batch_next + 1));
+		batch_reply[batch_reply_length] = transmit_data_length;
+		batch_reply_length += 1 + transmit_data_length;
+		batch_next += 1 + commands[i].payload_length;
+		if (delay_pending)
+			break;
+	}
+	if (!delay_pending)
+		batch_next = NULL; // batch finished
+	transmit_data = batch_reply;
+	transmit_data_length = batch_reply_length;
+}
+
 void interpret_command() {
-    if (received_data_length == 7 && strncmp(received_data,"CELL ON",7) == 0)
-        command_cell_on();
-    else if (received_data_length == 8 && strncmp(received_data,"CELL OFF",8) == 0)
-        command_cell_off();
-    else if (received_data_length == 14 && strncmp(received_data,"POTENTIOSTATIC",14) == 0)
-        command_mode_potentiostatic();
-    else if (received_data_length == 13 && strncmp(received_data,"GALVANOSTATIC",13) == 0)
-        command_mode_galvanostatic();
-    else if (received_data_length == 7 && strncmp(received_data,"RANGE 1",7) == 0)
-        command_range1();
-    else if (received_data_length == 7 && strncmp(received_data,"RANGE 2",7) == 0)
-        command_range2();
-    else if (received_data_length == 7 && strncmp(received_data,"RANGE 3",7) == 0)
-        command_range3();
-    else if (received_data_length == 10 && strncmp(received_data,"DACSET ",7) == 0)
-	command_set_dac(received_data+7);
-    else if (received_data_length == 6 && strncmp(received_data,"DACCAL",6) == 0)
-	command_calibrate_dac();
-    else if (received_data_length == 7 && strncmp(received_data,"ADCREAD",7) == 0)
-	command_read_adc();
-    else if (received_data_length == 10 && strncmp(received_data,"OFFSETREAD",10) == 0)
-	command_read_offset();
-    else if (received_data_length == 17 && strncmp(received_data,"OFFSETSAVE ",11) == 0)
-	command_save_offset(received_data+11);
-    else if (received_data_length == 9 && strncmp(received_data,"DACCALGET",9) == 0)
-	command_read_dac_cal();
-    else if (received_data_length == 16 && strncmp(received_data,"DACCALSET ",10) == 0)
-	command_set_dac_cal(received_data+10);
-    else if (received_data_length == 12 && strncmp(received_data,"SHUNTCALREAD",12) == 0)
-	command_read_shuntcalibration();
-    else if (received_data_length == 19 && strncmp(received_data,"SHUNTCALSAVE ",13) == 0)
-	command_save_shuntcalibration(received_data+13);
-    else
-        command_unknown();
+	const struct command* command;
+	uint8_t i;
+	if (received_data_length > 0 && received_data[0] == COMMAND_BATCH)
+	{
+		batch_next = received_data + 1;
+		batch_reply = transmit_data;
+		batch_reply_length = 0;
+		interpret_batch();
+		return;
+	}
+	if (received_data_length > 0 && received_data[0] >= COMMAND_OPCODE_BASE) // binary command: a single table lookup
+	{
+		i = received_data[0] - COMMAND_OPCODE_BASE;
+		if (i < NUM_COMMANDS && received_data_length == 1 + commands[i].payload_length)
+		{
+			PERF_MEASURE_COMMAND(i, commands[i].handler(received_data+1));
+			return;
+		}
+	}
+	else // ASCII command
+	{
+		for (i = 0, command = commands; i < NUM_COMMANDS; i++, command++)
+		{
+			if (received_data_length == command->name_length + command->payload_length && strncmp(received_data, command->name, command->name_length) == 0)
+			{
+				PERF_MEASURE_COMMAND(i, command->handler(received_data + command->name_length));
+				return;
+			}
+		}
+	}
+	command_unknown();
 }
 
 int main(void)
@@ -291,18 +1405,49 @@ int main(void)
 
 	while (1)
 	{
-		if (usb_is_configured() && usb_out_endpoint_has_data(1)) // wait for data received from host
+		relay_service(); // finish a range switch once the new relay has been made
+		sweep_service(); // step the DAC if a CV sweep is running
+		wave_service(); // apply the next buffered DAC code if a waveform is being played back
+		dac_cal_service(); // save the DAC self-calibration result once it is ready
+		if (!usb_is_configured())
 		{
-			if (!usb_in_endpoint_halted(1))
+			streaming_enabled = 0; // a new host session always starts in polled mode
+			delay_pending = 0; // the held-back reply is dropped with the endpoint buffers
+			batch_next = NULL;
+		}
+		if (streaming_enabled || cd_running)
+			stream_service(); // take conversions and push them to the host without being asked
+		if (delay_pending)
+		{
+			if ((int32_t)(ticks() - delay_end) >= 0)
+			{
+				delay_pending = 0;
+				if (batch_next != NULL)
+					PERF_MEASURE(&perf_counters[PERF_INTERPRET], interpret_batch()); // the rest of the batch, which may hold another DELAY
+				if (!delay_pending)
+				{
+					usb_send_in_buffer(1, transmit_data_length); // the reply that was held back
+					usb_arm_out_endpoint(1);
+				}
+			}
+		}
+		else if (usb_is_configured() && usb_out_endpoint_has_data(1)) // wait for data received from host
+		{
+			if (usb_in_endpoint_halted(1))
+				usb_arm_out_endpoint(1); // nowhere to send a reply; drop the command
+			else if (!usb_in_endpoint_busy(1)) // otherwise, leave the command pending until an EP1 IN buffer is free
 			{
-				while (usb_in_endpoint_busy(1)) // wait for EP1 IN to become free
-					;
 				received_data_length = usb_get_out_buffer(1, &received_data); // get memory location and length of received data
-				transmit_data = usb_get_in_buffer(1); // get memory location of data to transmit
-				interpret_command(); // this reads received_data and sets transmit_data and transmit_data_length
-				usb_send_in_buffer(1, transmit_data_length); // send the data back
+				transmit_data = usb_get_in_buffer(1); // get memory location of data to transmit (with ping-pong buffering, the one not in flight)
+				PERF_MEASURE(&perf_counters[PERF_INTERPRET], interpret_command()); // this reads received_data and sets transmit_data and transmit_data_length
+				if (!delay_pending) // otherwise, the reply is sent once the DELAY has passed
+				{
+					usb_send_in_buffer(1, transmit_data_length); // send the data back
+					usb_arm_out_endpoint(1);
+				}
 			}
-			usb_arm_out_endpoint(1);
+			else
+				PERF_EVENT(ep1_busy);
 		}
 	}
 
@@ -311,5 +1456,15 @@ int main(void)
 
 void interrupt isr()
 {
+	if (PIR1bits.TMR2IF) // 1 ms acquisition clock
+	{
+		PIR1bits.TMR2IF = 0;
+		tick_count++;
+	}
+#ifdef PERF_STATS
+	if (PIR2bits.USBIF) // most interrupts are ticks, in which usb_service() has nothing to do
+		PERF_MEASURE(&perf_counters[PERF_USB_SERVICE], usb_service());
+	else
+#endif
 	usb_service();
 }
@@ -2,6 +2,8 @@
 
 #define _XTAL_FREQ 48000000     // 48 MHz CPU clock frequency
 
+static uint8_t spi_profile = SPI_PROFILE_DAC1220; // timing profile of the selected chip, used by SPIDelay()
+
 void InitializeSPI()
 {
 	// Initialize the chip select lines as inactive
@@ -19,102 +21,126 @@ void InitializeSPI()
 }
 
 uint8_t MCP3550_Read(uint8_t* adc_data)
+{
+	if(!MCP3550_ReadResult(adc_data))
+		return 0;
+	MCP3550_Start(); // Initiate a new conversion
+	return 1;
+}
+
+uint8_t MCP3550_ReadResult(uint8_t* adc_data)
 {
 	uint8_t data_ready = 0;
-	// Poll conversion status
-	CS2_LAT = LOW;
-	SPIDelay();
+	// Poll conversion status; if the ADCs are idle, this starts a conversion
+	MCP3550_Select();
 	if(!DATA1_PIN) // conversions are ready
 	{
 		Read2BytesSPI(adc_data,adc_data+3);
 		Read2BytesSPI(adc_data+1,adc_data+4);
 		Read2BytesSPI(adc_data+2,adc_data+5);
 		data_ready = 1;
-		// Initiate a new conversion
-		CS2_LAT = HIGH;
-		SPIDelay();
-		CS2_LAT = LOW;
-		SPIDelay();
 	}
+	MCP3550_Deselect();
+	return data_ready;
+}
+
+void MCP3550_Start()
+{
+	// A falling edge on the chip select line starts a single conversion
+	MCP3550_Select();
+	MCP3550_Deselect();
+}
+
+void MCP3550_Select()
+{
+	spi_profile = SPI_PROFILE_MCP3550;
+	CS2_LAT = LOW;
+	SPIDelay();
+}
+
+void MCP3550_Deselect()
+{
 	CS2_LAT = HIGH;
 	SPIDelay();
-	return data_ready;
 }
 
-void DAC1220_Reset()
+void DAC1220_Select()
 {
+	spi_profile = SPI_PROFILE_DAC1220;
 	CS1_LAT = LOW;
 	SPIDelay();
+}
+
+void DAC1220_Deselect()
+{
+	CS1_LAT = HIGH;
+	SPIDelay();
+}
+
+void DAC1220_Reset()
+{
+	DAC1220_Select();
 	CLOCK_LAT = HIGH;
 	__delay_us(264);
 	CLOCK_LAT = LOW;
-	SPIDelay();
+	__delay_us(DAC1220_RESET_GAP_US);
 	CLOCK_LAT = HIGH;
 	__delay_us(570);
 	CLOCK_LAT = LOW;
-	SPIDelay();
+	__delay_us(DAC1220_RESET_GAP_US);
 	CLOCK_LAT = HIGH;
 	__delay_us(903);
 	CLOCK_LAT = LOW;
-	SPIDelay();
-	CS1_LAT = HIGH;
-	SPIDelay();
+	__delay_us(DAC1220_RESET_GAP_US);
+	DAC1220_Deselect();
 }
 
 void DAC1220_Write2Bytes(const uint8_t address, const uint8_t byte1, const uint8_t byte2)
 {
-	CS1_LAT = LOW;
-	SPIDelay();
+	DAC1220_Select();
 	DATA1_DIR = OUTPUT;
 	WriteByteSPI(32+address);
 	WriteByteSPI(byte1);
 	WriteByteSPI(byte2);
 	DATA1_DIR = INPUT;
-	CS1_LAT = HIGH;
-	SPIDelay();
+	DAC1220_Deselect();
 }
 
 void DAC1220_Write3Bytes(const uint8_t address, const uint8_t byte1, const uint8_t byte2, const uint8_t byte3)
 {
-	CS1_LAT = LOW;
-	SPIDelay();
+	DAC1220_Select();
 	DATA1_DIR = OUTPUT;
 	WriteByteSPI(64+address);
 	WriteByteSPI(byte1);
 	WriteByteSPI(byte2);
 	WriteByteSPI(byte3);
 	DATA1_DIR = INPUT;
-	CS1_LAT = HIGH;
-	SPIDelay();
+	DAC1220_Deselect();
 }
 
 void DAC1220_Read2Bytes(const uint8_t address, uint8_t* byte1, uint8_t* byte2)
 {
-	CS1_LAT = LOW;
-	SPIDelay();
+	DAC1220_Select();
 	DATA1_DIR = OUTPUT;
 	WriteByteSPI(160+address);
 	DATA1_DIR = INPUT;
-	SPIDelay();
+	__delay_us(DAC1220_READ_DELAY_US); // the DAC1220 needs time to fetch the register contents
 	*byte1 = ReadByteSPI();
 	*byte2 = ReadByteSPI();
-	CS1_LAT = HIGH;
-	SPIDelay();
+	DAC1220_Deselect();
 }
 
 void DAC1220_Read3Bytes(const uint8_t address, uint8_t* byte1, uint8_t* byte2, uint8_t* byte3)
 {
-	CS1_LAT = LOW;
-	SPIDelay();
+	DAC1220_Select();
 	DATA1_DIR = OUTPUT;
 	WriteByteSPI(192+address);
 	DATA1_DIR = INPUT;
-	SPIDelay();
+	__delay_us(DAC1220_READ_DELAY_US); // the DAC1220 needs time to fetch the register contents
 	*byte1 = ReadByteSPI();
 	*byte2 = ReadByteSPI();
 	*byte3 = ReadByteSPI();
-	CS1_LAT = HIGH;
-	SPIDelay();
+	DAC1220_Deselect();
 }
 
 void DAC1220_Init()
@@ -184,5 +210,9 @@ void ClockPulse()
 
 void SPIDelay()
 {
-	_delay(200); // delay of 100 instruction cycles (=17 us at Fosc=48 MHz)
+	// half a clock period, for the chip selected last
+	if (spi_profile == SPI_PROFILE_MCP3550)
+		_delay(MCP3550_HALF_PERIOD);
+	else
+		_delay(DAC1220_HALF_PERIOD);
 }
@@ -6,6 +6,13 @@
 #include <stdlib.h>
 #include <xc.h>
 
+// The MSSP peripheral is not used: on this board its pins are taken by other
+// signals (SDI=RB4 is DATA1, SCK=RB6 is CS1, SDO=RC7 is DATA2), and the DAC1220
+// shares its bidirectional SDIO line with the ADC's data output. Since the
+// DAC1220 limits SCLK to 1/10 of its 2.5 MHz crystal anyway, a hardware write
+// would not be faster than the software one (32 bits in about 160 us), and USB
+// servicing is interrupt-driven, so it is not held up by DAC writes.
+
 #define LOW 0
 #define HIGH 1
 
@@ -29,8 +36,23 @@
 #define CS2_LAT LATBbits.LATB7
 #define CS2_DIR TRISBbits.TRISB7
 
+// Timing profiles, from the datasheet minimums with some margin; delays are in
+// instruction cycles (83 ns at Fosc=48 MHz) unless noted otherwise
+#define SPI_PROFILE_DAC1220 0
+#define SPI_PROFILE_MCP3550 1
+#define DAC1220_HALF_PERIOD 30 // SCLK high/low time of at least 5 tXIN (2 us with its 2.5 MHz crystal)
+#define DAC1220_READ_DELAY_US 6 // at least 13 tXIN (5.2 us) between a read command and its data
+#define DAC1220_RESET_GAP_US 10 // SCLK low time between the reset pulses, at least 10 tXIN (4 us)
+#define MCP3550_HALF_PERIOD 3 // SCK high/low time of at least 90 ns (5 MHz maximum clock)
+
 void InitializeSPI();
 uint8_t MCP3550_Read(uint8_t* adc_data);
+uint8_t MCP3550_ReadResult(uint8_t* adc_data);
+void MCP3550_Start();
+void MCP3550_Select();
+void MCP3550_Deselect();
+void DAC1220_Select();
+void DAC1220_Deselect();
 void DAC1220_Reset();
 void DAC1220_Write2Bytes(const uint8_t address, const uint8_t byte1, const uint8_t byte2);
 void DAC1220_Write3Bytes(const uint8_t address, const uint8_t byte1, const uint8_t byte2, const uint8_t byte3);
@@ -50,6 +50,10 @@
 #ifdef __PIC32MX__
 	/* PIC32MX only supports PPB_ALL */
 	#define PPB_MODE PPB_ALL
+#elif defined(EP1_PINGPONG)
+	/* Build option (see Makefile): double-buffer EP1 so that a new packet
+	   can be prepared while the previous one is still in flight */
+	#define PPB_MODE PPB_EPN_ONLY
 #else
 	#define PPB_MODE PPB_NONE
 #endif
@@ -64,6 +68,10 @@
 #define USB_CONFIG_DESCRIPTOR_MAP usb_application_config_descs
 #define USB_STRING_DESCRIPTOR_FUNC usb_application_get_string
 
+/* Maximum length of the serial number string descriptor, which is set at
+   startup from HEFLASH so that the host can tell several boards apart */
+#define SERIAL_NUMBER_LENGTH 8
+
 /* The Setup Request number (bRequest) to tell the host to use for the
  * Microsoft descriptors. See docs/winusb.txt for details. */
 // #define MICROSOFT_OS_DESC_VENDOR_CODE 0x50
@@ -181,12 +181,26 @@ static const ROMPTR struct {uint8_t bLength;uint8_t bDescriptorType; uint16_t ch
 	{'I','n','t','e','r','f','a','c','e',' ','1'}
 };
 
-static const ROMPTR struct {uint8_t bLength;uint8_t bDescriptorType; uint16_t chars[4]; } serial_string = {
-	sizeof(serial_string),
+/* The serial number string lives in RAM, so that each board can report the
+   number stored in its HEFLASH (see usb_set_serial_number()). */
+static struct {uint8_t bLength;uint8_t bDescriptorType; uint16_t chars[SERIAL_NUMBER_LENGTH]; } serial_string = {
+	2 + 2*4,
 	DESC_STRING,
 	{'0','0','0','1'}
 };
 
+/* Set the serial number string from up to SERIAL_NUMBER_LENGTH printable
+ * ASCII characters, terminated early by any other byte. If there are none
+ * (e.g. erased flash), the default serial number is kept. */
+void usb_set_serial_number(const uint8_t *serial)
+{
+	uint8_t i;
+	for (i = 0; i < SERIAL_NUMBER_LENGTH && serial[i] >= ' ' && serial[i] <= '~'; i++)
+		serial_string.chars[i] = serial[i];
+	if (i > 0)
+		serial_string.bLength = 2 + 2*i;
+}
+
 /* Get String function
  *
  * This function is called by the USB stack to get a pointer to a string
@@ -213,7 +227,7 @@ int16_t usb_application_get_string(uint8_t string_number, const void **ptr)
 	}
 	else if (string_number == 3) {
 		*ptr = &serial_string;
-		return sizeof(serial_string);
+		return serial_string.bLength;
 	}
 
 	return -1;
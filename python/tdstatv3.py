@@ -3,7 +3,9 @@
 
 # This Python program allows control over the USB potentiostat/galvanostat using a graphical user interface. It supports real-time data acquisition and plotting, manual control and 
 # calibration, and three pre-programmed measurement methods geared towards battery research (staircase cyclic voltammetry, constant-current charge/discharge, and rate testing).
-# It is cross-platform, requiring only a working installation of Python 3.x together with the Numpy, Scipy, PyUSB, and PyQtGraph packages.
+# It is cross-platform, requiring only a working installation of Python 3.x together with the Numpy, PyUSB, and PyQtGraph packages.
+# The device protocol, calibration math and data storage are implemented in tdstatv3_engine.py, which can also be used without this GUI (see tdstatv3_cli.py).
+# Started with the --emulate option, it connects to a software model of the device (see tdstatv3_emulator.py) instead of a USB device.
 
 # Author: Thomas Dobbelaere
 # License: GPL
@@ -12,21 +14,22 @@ import pyqtgraph
 from pyqtgraph.Qt import QtCore, QtGui
 import sys, platform
 import time, datetime, timeit
-import usb.core, usb.util
+import usb.core
 import os.path
 import collections
 import numpy
-import scipy.integrate
+import tdstatv3_engine as engine
+from tdstatv3_engine import Calibration, CalibrationCache, Device, AverageBuffer, ChargeBuffer, LogWriter, OutputWriter, export_log_to_text, find_devices, current_range_from_current, CVWaveform, charge_from_cv, decimal_to_dac_bytes, float_to_twobytes, twocomplement_to_decimal, cv_sweep_command, cd_start_command, autorange_command, current_range_list, serial_number_length, stream_flag_sweep, stream_flag_cd, stream_flag_cd_phase, stream_flag_invalid
 
-usb_vid = "0xa0a0" # Default USB vendor ID, can also be adjusted in the GUI
-usb_pid = "0x0002" # Default USB product ID, can also be adjusted in the GUI
-current_range_list = ["20 mA", u"200 µA", u"2 µA"]
-shunt_calibration = [1.,1.,1.] # Fine adjustment for shunt resistors, containing values of R1/10ohm, R2/1kohm, R3/100kohm (can also be adjusted in the GUI)
+usb_vid = "0x%04x"%engine.usb_vid # Default USB vendor ID, can also be adjusted in the GUI
+usb_pid = "0x%04x"%engine.usb_pid # Default USB product ID, can also be adjusted in the GUI
+usb_serial = "" # Serial number of the device to connect to, can also be adjusted in the GUI; if empty, the first device found is used
 currentrange = 0 # Default current range (expressed as index in current_range_list)
 units_list = ["Potential (V)", "Current (mA)", "DAC Code"]
-dev = None # Global object which is reserved for the USB device
-current_offset = 0. # Current offset in DAC counts
-potential_offset = 0. # Potential offset in DAC counts
+dev = None # Global object which is reserved for the USB device (an engine.Device)
+emulated_devices = [] # Emulated devices, offered instead of USB devices when started with --emulate
+calibration = Calibration() # Offset and shunt calibration (can be adjusted in the GUI)
+calibration_cache = CalibrationCache() # Calibration values of devices connected before, so that reconnecting does not need to read flash memory
 potential = 0. # Measured potential in V
 current = 0. # Measured current in mA
 last_potential_values = collections.deque(maxlen=200)
@@ -42,6 +45,17 @@ overcounter, undercounter, skipcounter = 0, 0, 0 # Global counters used for auto
 time_of_last_adcread = 0.
 adcread_interval = 0.09 # ADC sampling interval (in seconds)
 logging_enabled = False # Enable logging of potential and current in idle mode (can be adjusted in the GUI)
+log_writer = None # Open binary log file while logging is enabled (see LogWriter)
+cd_device_phase = 0 # Phase (0 or 1) of the device's charge/discharge controller, as last seen in the data frames
+cd_device_started = False # True once a data frame has shown the device's charge/discharge controller running after CDSTART
+sample_flags = 0 # Data frame flags of the last sample read
+streaming_enabled = False # True when the firmware pushes its conversions to the host by itself (see stream_start())
+stream_gui_period = 20 # Time (in ms) between two GUI updates in streaming mode
+stream_gui_max_samples = 100 # Maximum number of queued samples processed in a single GUI update
+plot_refresh_interval = 0.04 # Minimum time (in s) between two redraws of the plot curves, independent of the sample rate
+pending_plot_updates = collections.OrderedDict() # Plot curves waiting to be redrawn, mapped to a function returning their new (x, y) data
+last_plot_refresh = 0. # Time of the last redraw
+stream_latency_batched = 1000 # Time (in ms) samples may be held back by the device to pack them into full frames (used for long measurements)
 
 if platform.system() != "Windows":
 	# On Linux/OSX, use the Qt timer
@@ -52,23 +66,6 @@ else:
 	busyloop_interval = adcread_interval
 	qt_timer_period = 0
 
-class AverageBuffer:
-	"""Collect samples and compute an average as soon as a sufficient number of samples is added."""
-	def __init__(self, number_of_samples_to_average):
-		self.number_of_samples_to_average = number_of_samples_to_average
-		self.samples = []
-		self.averagebuffer = []
-	
-	def add_sample(self, sample):
-		self.samples.append(sample)
-		if len(self.samples) >= self.number_of_samples_to_average:
-			self.averagebuffer.append(sum(self.samples)/len(self.samples))
-			self.samples = []
-			
-	def clear(self):
-		self.samples = []
-		self.averagebuffer = []
-
 class States:
 	"""Expose a named list of states to be used as a simple state machine."""
 	NotConnected, Idle_Init, Idle, Measuring_Offset, Stationary_Graph, Measuring_CV, Measuring_CD, Measuring_Rate = range(8)
@@ -95,98 +92,6 @@ def potential_to_string(potential_in_V):
 	"""Format the measured potential into a string with appropriate units and number of significant digits."""
 	return u"%+6.3f V"%potential_in_V
 
-def twocomplement_to_decimal(msb, middlebyte, lsb):
-	"""Convert a 22-bit two-complement ADC value consisting of three bytes to a signed integer (see MCP3550 datasheet for details)."""
-	ovh = (msb > 63) and (msb < 128) # Check for overflow high (B22 set)
-	ovl = (msb > 127) # Check for overflow low (B23 set)
-	combined_value = (msb%64)*2**16+middlebyte*2**8+lsb # Get rid of overflow bits
-	if not ovh and not ovl:
-		if msb > 31: # B21 set -> negative number
-			answer = combined_value - 2**22
-		else:
-			answer = combined_value
-	else: # overflow
-		if msb > 127: # B23 set -> negative number
-			answer = combined_value - 2**22
-		else:
-			answer = combined_value
-	return answer
-
-def decimal_to_dac_bytes(value):
-	"""Convert a floating-point number, ranging from -2**19 to 2**19-1, to three data bytes in the proper format for the DAC1220."""
-	code = 2**19 + int(round(value)) # Convert the (signed) input value to an unsigned 20-bit integer with zero at midway
-	code = numpy.clip(code, 0, 2**20 - 1) # If the input exceeds the boundaries of the 20-bit integer, clip it
-	byte1 = code // 2**12
-	byte2 = (code % 2**12) // 2**4
-	byte3 = (code - byte1*2**12 - byte2*2**4)*2**4
-	return bytes([byte1,byte2,byte3])
-	
-def dac_bytes_to_decimal(dac_bytes):
-	"""Convert three data bytes in the DAC1220 format to a 20-bit number ranging from -2**19 to 2**19-1."""
-	code = 2**12*dac_bytes[0]+2**4*dac_bytes[1]+dac_bytes[2]/2**4
-	return code - 2**19
-	
-def cv_sweep(time_elapsed, ustart, ustop, ubound, lbound, scanrate, n):
-	"""Generate the potential profile for a cyclic voltammetry sweep.
-	
-	Keyword arguments:
-	time_elapsed -- the elapsed time
-	ustart -- the start potential
-	ustop -- the stop potential
-	ubound -- the upper potential bound
-	lbound -- the lower potential bound
-	scanrate -- the scan rate
-	n -- the number of scans
-	
-	Returns the potential as a function of the elapsed time; if the elapsed time exceeds the end of the CV sweep, returns None.
-	"""
-	if scanrate < 0: # The rest of the function assumes a positive scan rate; a negative one is handled here by recursion
-		try:
-			return -cv_sweep(time_elapsed, -ustart, -ustop, -lbound, -ubound, -scanrate, n) # Re-run the function with inverted potentials and scan rates and invert the result
-		except TypeError:
-			return None # If the result of the inverted function is None, it cannot be inverted, so return None
-	srt_0 = ubound-ustart # Potential difference to traverse in the initial stage (before potential reaches upper bound)
-	srt_1 = (ubound-lbound)*2.*n # Potential difference to traverse in the "cyclic stage" (repeated scans from upper to lower bound and back)
-	srt_2 = abs(ustop-ubound) # Potential difference to traverse in the final stage (from upper bound to stop potential)
-	srtime = scanrate*time_elapsed # Linear potential sweep
-	if srtime < srt_0: # Initial stage
-		return ustart+srtime
-	elif srtime < srt_0+srt_1: # Cyclic stage
-		srtime = srtime - srt_0
-		return lbound + abs((srtime)%(2*(ubound-lbound))-(ubound-lbound))
-	elif srtime < srt_0+srt_1+srt_2: # Final stage
-		srtime = srtime - srt_0 - srt_1
-		if ustop > ubound:
-			return ubound + srtime
-		else:
-			return ubound - srtime
-	else:
-		return None # CV finished
-
-def charge_from_cv(time_arr, current_arr):
-	"""Integrate current as a function of time to calculate charge between zero crossings."""
-	zero_crossing_indices = []
-	charge_arr = []
-	running_index = 0
-	while running_index < len(current_arr):
-		counter = 0
-		while running_index < len(current_arr) and current_arr[running_index] >= 0.: # Iterate over a block of positive currents
-			running_index += 1
-			counter += 1
-		if counter >= 10: # Check if the block holds at least 10 values (this makes the counting immune to noise around zero crossings)
-			zero_crossing_indices.append(running_index-counter) # If so, append the index of the start of the block to the list of zero-crossing indices
-		counter = 0
-		while running_index < len(current_arr) and current_arr[running_index] <= 0.: # Do the same for a block of negative currents
-			running_index += 1
-			counter += 1
-		if counter >= 10:
-			zero_crossing_indices.append(running_index-counter)
-	for index in range(0,len(zero_crossing_indices)-1): # Go over all zero crossings
-		zc_index1 = zero_crossing_indices[index] # Start index
-		zc_index2 = zero_crossing_indices[index+1] # End index
-		charge_arr.append(numpy.trapz(current_arr[zc_index1:zc_index2],time_arr[zc_index1:zc_index2])*1000./3.6) # Integrate current over time using the trapezoid rule, convert coulomb to uAh
-	return charge_arr
-
 def make_groupbox_indicator(title_name, default_text):
 	"""Make a GUI box (used for the potential, current, and status indicators)."""
 	label = QtGui.QLabel(text=default_text, alignment=QtCore.Qt.AlignCenter)
@@ -242,7 +147,11 @@ def connect_disconnect_usb():
 	"""Toggle the USB device between connected and disconnected states."""
 	global dev, state
 	if dev is not None: # If the device is already connected, then this function should disconnect it
-		usb.util.dispose_resources(dev)
+		try:
+			stream_stop()
+		except usb.core.USBError:
+			pass # In case the device was already unplugged
+		dev.close()
 		dev = None
 		state = States.NotConnected
 		hardware_usb_connectButton.setText("Connect")
@@ -251,22 +160,38 @@ def connect_disconnect_usb():
 	# Otherwise, try to connect
 	usb_vid_string = str(hardware_usb_vid.text())
 	usb_pid_string = str(hardware_usb_pid.text())
-	dev = usb.core.find(idVendor=int(usb_vid_string, 0), idProduct=int(usb_pid_string, 0))
-	if dev is None:
-		QtGui.QMessageBox.critical(mainwidget, "USB Device Not Found", "No USB device was found with VID %s and PID %s. Verify the vendor/product ID and check the USB connection."%(usb_vid_string,usb_pid_string))
+	usb_serial_string = str(hardware_usb_serial.text()).strip()
+	devices = [(device.serial_number, device) for device in emulated_devices] if emulated_devices else find_devices(int(usb_vid_string, 0), int(usb_pid_string, 0))
+	if len(devices) > 1:
+		log_message("Found %d USB devices, with serial numbers: %s"%(len(devices), ", ".join(str(serial) for serial, device in devices)))
+	matching_devices = [device for serial, device in devices if usb_serial_string in ("", serial)]
+	if len(matching_devices) == 0:
+		QtGui.QMessageBox.critical(mainwidget, "USB Device Not Found", "No USB device was found with VID %s and PID %s%s. Verify the vendor/product ID and serial number, and check the USB connection."%(usb_vid_string,usb_pid_string," and serial number %s"%usb_serial_string if usb_serial_string != "" else ""))
 	else:
+		dev = Device(matching_devices[0], calibration) # From now on, all reads from the device go through its reader thread
 		hardware_usb_connectButton.setText("Disconnect")
 		log_message("USB Interface connected.")
 		try:
 			hardware_device_info_text.setText("Manufacturer: %s\nProduct: %s\nSerial #: %s"%(dev.manufacturer,dev.product,dev.serial_number))
-			get_calibration()
+			if dev.detect_binary_protocol():
+				log_message("Firmware binary command protocol enabled.")
+			get_calibration(use_cache=True)
 			set_cell_status(False) # Cell off
 			set_control_mode(False) # Potentiostatic control
 			set_current_range() # Read current range from GUI
+			if stream_start():
+				log_message("Firmware streaming mode enabled.")
 			state = States.Idle_Init # Start idle mode
 		except ValueError:
 			pass # In case the device is not yet calibrated
 
+def set_serial_number():
+	"""Store a new serial number in the device's flash memory, so that it can be told apart from other devices."""
+	serial = str(hardware_device_serial_entry.text()).strip().encode("ascii", "ignore")[:serial_number_length]
+	if len(serial) == 0:
+		return
+	send_command(b'SERIALSET '+serial.ljust(serial_number_length, b'\x00'), b'OK', "Serial number saved to flash memory; the host may only see it after reconnecting the USB cable.")
+
 def not_connected_errormessage():
 	"""Generate an error message stating that the device is not connected."""
 	QtGui.QMessageBox.critical(mainwidget, "Not connected", "This command cannot be executed because the USB device is not connected. Press the \"Connect\" button and try again.")
@@ -282,11 +207,42 @@ def check_state(desired_states):
 	else:
 		return True
 
+def set_stream_latency(latency):
+	"""Set the time (in ms) the device may hold back samples in order to pack them into fewer data frames."""
+	if streaming_enabled:
+		send_command(b'STREAM LATENCY '+bytes([latency//256, latency%256]), b'OK')
+
+def set_stream_decimation(factor):
+	"""Let the device average blocks of a given number of conversions into single streamed samples; return the number of samples the host still has to average itself."""
+	if not streaming_enabled:
+		return factor
+	if factor > 255: # Too many for the device, so leave the averaging to the host
+		send_command(b'DECIMATION '+bytes([1]), b'OK')
+		return factor
+	send_command(b'DECIMATION '+bytes([max(1, factor)]), b'OK')
+	return 1
+
+def stream_start():
+	"""Put the device in streaming mode, in which it sends every completed conversion without being polled. Returns False if the firmware does not support this."""
+	global streaming_enabled
+	if not dev.stream_start():
+		return False
+	streaming_enabled = True
+	timer.setInterval(stream_gui_period) # The device now paces the sampling; the GUI processes the queued samples at its own rate
+	return True
+
+def stream_stop():
+	"""Return the device to polled mode (see stream_start())."""
+	global streaming_enabled
+	if streaming_enabled:
+		dev.stream_stop()
+		streaming_enabled = False
+		timer.setInterval(qt_timer_period)
+
 def send_command(command_string, expected_response, log_msg=None):
 	"""Send a command string to the USB device and check the response; optionally logs a message to the message log."""
 	if dev is not None: # Make sure it's connected
-		dev.write(0x01,command_string) # 0x01 = write address of EP1
-		response = bytes(dev.read(0x81,64)) # 0x81 = read address of EP1
+		response = dev.command(command_string, None)
 		if response != expected_response:
 			QtGui.QMessageBox.critical(mainwidget, "Unexpected Response", "The command \"%s\" resulted in an unexpected response. The expected response was \"%s\"; the actual response was \"%s\""%(command_string,expected_response.decode("ascii"),response.decode("ascii")))
 		else:
@@ -315,6 +271,13 @@ def set_control_mode(galvanostatic_boolean):
 		if send_command(b'POTENTIOSTATIC', b'OK'):
 			control_mode_monitor.setText("POTENTIOSTATIC")
 
+def track_current_range(index):
+	"""Update the GUI and the current range bookkeeping after the device has switched the current range by itself."""
+	global currentrange
+	hardware_manual_control_range_dropdown.setCurrentIndex(index)
+	current_range_monitor.setText(current_range_list[index])
+	currentrange = index
+
 def set_current_range():
 	"""Switch the current range based on the GUI dropdown selection."""
 	global currentrange
@@ -351,15 +314,10 @@ def auto_current_range():
 	else:
 		return 0
 		
-def current_range_from_current(current):
-	"""Return the current range that best corresponds to a given current."""
-	current = abs(current)
-	if current <= 0.002:
-		return 2 # Lowest current range (2 uA)
-	elif current <= 0.2:
-		return 1 # Intermediate current range (200 uA)
-	else:
-		return 0 # Highest current range (20 mA)
+def set_device_autorange(enabled):
+	"""Let the device switch the current range by itself, using the same thresholds as auto_current_range(), or stop it from doing so."""
+	enabled_ranges = [i for i in range(3) if cv_range_checkboxes[i].isChecked()] if enabled else [] # Current ranges the device may switch to
+	send_command(autorange_command(calibration, enabled_ranges), b'OK')
 
 def get_next_enabled_current_range(desired_currentrange):
 	"""Return an enabled current range that best corresponds to a desired current range."""
@@ -379,56 +337,13 @@ def get_next_enabled_current_range(desired_currentrange):
 
 def set_offset():
 	"""Save offset values to the device's flash memory."""
-	send_command(b'OFFSETSAVE '+decimal_to_dac_bytes(potential_offset)+decimal_to_dac_bytes(current_offset), b'OK', "Offset values saved to flash memory.")
-
-def get_offset():
-	"""Retrieve offset values from the device's flash memory."""
-	global potential_offset, current_offset
-	if dev is not None: # Make sure it's connected
-		dev.write(0x01,b'OFFSETREAD') # 0x01 = write address of EP1
-		response = bytes(dev.read(0x81,64)) # 0x81 = read address of EP1
-		if response != bytes([255,255,255,255,255,255]): # If no offset value has been stored, all bits will be set
-			potential_offset = dac_bytes_to_decimal(response[0:3])
-			current_offset = dac_bytes_to_decimal(response[3:6])	
-			hardware_calibration_potential_offset.setText("%d"%potential_offset)
-			hardware_calibration_current_offset.setText("%d"%current_offset)	
-			log_message("Offset values read from flash memory.")
-		else:
-			log_message("No offset values were found in flash memory.")
-	else:
-		not_connected_errormessage()
-
-def float_to_twobytes(value):
-	"""Convert a floating-point number ranging from -2^15 to 2^15-1 to a 16-bit representation stored in two bytes."""
-	code = 2**15 + int(round(value))
-	code = numpy.clip(code, 0, 2**16 - 1) # If the code exceeds the boundaries of a 16-bit integer, clip it
-	byte1 = code // 2**8
-	byte2 = code % 2**8
-	return bytes([byte1,byte2])
-
-def twobytes_to_float(bytes_in):
-	"""Convert two bytes to a number ranging from -2^15 to 2^15-1."""
-	code = 2**8*bytes_in[0]+bytes_in[1]
-	return float(code - 2**15)
+	forget_cached_calibration()
+	send_command(b'OFFSETSAVE '+decimal_to_dac_bytes(calibration.potential_offset)+decimal_to_dac_bytes(calibration.current_offset), b'OK', "Offset values saved to flash memory.")
 
 def set_shunt_calibration():
 	"""Save shunt calibration values to the device's flash memory."""
-	send_command(b'SHUNTCALSAVE '+float_to_twobytes((shunt_calibration[0]-1.)*1e6)+float_to_twobytes((shunt_calibration[1]-1.)*1e6)+float_to_twobytes((shunt_calibration[2]-1.)*1e6), b'OK', "Shunt calibration values saved to flash memory.")
-
-def get_shunt_calibration():
-	"""Retrieve shunt calibration values from the device's flash memory."""
-	if dev is not None: # Make sure it's connected
-		dev.write(0x01,b'SHUNTCALREAD') # 0x01 = write address of EP1
-		response = bytes(dev.read(0x81,64)) # 0x81 = read address of EP1
-		if response != bytes([255,255,255,255,255,255]): # If no calibration value has been stored, all bits are set
-			for i in range(0,3):
-				shunt_calibration[i] = 1.+twobytes_to_float(response[2*i:2*i+2])/1e6 # Yields an adjustment range from 0.967 to 1.033 in steps of 1 ppm
-				hardware_calibration_shuntvalues[i].setText("%.4f"%shunt_calibration[i])
-			log_message("Shunt calibration values read from flash memory.")
-		else:
-			log_message("No shunt calibration values were found in flash memory.")
-	else:
-		not_connected_errormessage()
+	forget_cached_calibration()
+	send_command(b'SHUNTCALSAVE '+b''.join(float_to_twobytes((value-1.)*1e6) for value in calibration.shunt_calibration), b'OK', "Shunt calibration values saved to flash memory.")
 
 def zero_offset():
 	"""Calculate offset values in order to zero the potential and current."""
@@ -442,14 +357,13 @@ def zero_offset():
 
 def offset_changed_callback():
 	"""Set the potential and current offset from the input fields."""
-	global potential_offset, current_offset
 	try:
-		potential_offset = int(hardware_calibration_potential_offset.text())
+		calibration.potential_offset = int(hardware_calibration_potential_offset.text())
 		hardware_calibration_potential_offset.setStyleSheet("")
 	except ValueError: # If the input field cannot be interpreted as a number, color it red
 		hardware_calibration_potential_offset.setStyleSheet("QLineEdit { background: red; }")
 	try:
-		current_offset = int(hardware_calibration_current_offset.text())
+		calibration.current_offset = int(hardware_calibration_current_offset.text())
 		hardware_calibration_current_offset.setStyleSheet("")
 	except ValueError: # If the input field cannot be interpreted as a number, color it red
 		hardware_calibration_current_offset.setStyleSheet("QLineEdit { background: red; }")
@@ -458,7 +372,7 @@ def shunt_calibration_changed_callback():
 	"""Set the shunt calibration values from the input fields."""
 	for i in range(0,3):
 		try:
-			shunt_calibration[i] = float(hardware_calibration_shuntvalues[i].text())
+			calibration.shunt_calibration[i] = float(hardware_calibration_shuntvalues[i].text())
 			hardware_calibration_shuntvalues[i].setStyleSheet("")
 		except ValueError: # If the input field cannot be interpreted as a number, color it red
 			hardware_calibration_shuntvalues[i].setStyleSheet("QLineEdit { background: red; }")
@@ -477,23 +391,36 @@ def set_dac_calibration():
 	except ValueError: # If the input field cannot be interpreted as a number, color it red
 		hardware_calibration_dac_gain.setStyleSheet("QLineEdit { background: red; }")
 		return
+	forget_cached_calibration()
 	send_command(b'DACCALSET '+decimal_to_dac_bytes(dac_offset)+decimal_to_dac_bytes(dac_gain-2**19), b'OK', "DAC calibration saved to flash memory.")
 
-def get_dac_calibration():
-	"""Retrieve DAC calibration values from the device's flash memory."""
-	if dev is not None: # Make sure it's connected
-		dev.write(0x01,b'DACCALGET') # 0x01 = write address of EP1
-		response = bytes(dev.read(0x81,64)) # 0x81 = write address of EP1
-		if response != bytes([255,255,255,255,255,255]): # If no calibration value has been stored, all bits are set
-			dac_offset = dac_bytes_to_decimal(response[0:3])
-			dac_gain = dac_bytes_to_decimal(response[3:6])+2**19
-			hardware_calibration_dac_offset.setText("%d"%dac_offset)
-			hardware_calibration_dac_gain.setText("%d"%dac_gain)
-			log_message("DAC calibration read from flash memory.")
-		else:
-			log_message("No DAC calibration values were found in flash memory.")
+def show_calibration(offsets, dac_calibration, shunt_calibration, source):
+	"""Apply calibration values read from the device (see Device.read_calibration()) and show them in the GUI; source names where they were read from."""
+	if dac_calibration is not None:
+		hardware_calibration_dac_offset.setText("%d"%dac_calibration[0])
+		hardware_calibration_dac_gain.setText("%d"%dac_calibration[1])
+		log_message("DAC calibration read from %s."%source)
 	else:
-		not_connected_errormessage()
+		log_message("No DAC calibration values were found in %s."%source)
+	if offsets is not None:
+		calibration.potential_offset, calibration.current_offset = offsets
+		hardware_calibration_potential_offset.setText("%d"%calibration.potential_offset)
+		hardware_calibration_current_offset.setText("%d"%calibration.current_offset)
+		log_message("Offset values read from %s."%source)
+	else:
+		log_message("No offset values were found in %s."%source)
+	if shunt_calibration is not None:
+		for i in range(0,3):
+			calibration.shunt_calibration[i] = shunt_calibration[i]
+			hardware_calibration_shuntvalues[i].setText("%.4f"%shunt_calibration[i])
+		log_message("Shunt calibration values read from %s."%source)
+	else:
+		log_message("No shunt calibration values were found in %s."%source)
+
+def forget_cached_calibration():
+	"""Drop the cached calibration values of the connected device, which are about to be overwritten."""
+	if dev is not None:
+		calibration_cache.forget(dev.serial_number)
 
 def set_calibration():
 	"""Save all calibration values to the device's flash memory."""
@@ -501,23 +428,46 @@ def set_calibration():
 	set_offset()
 	set_shunt_calibration()
 
-def get_calibration():
-	"""Retrieve all calibration values from the device's flash memory."""
-	get_dac_calibration()
-	get_offset()
-	get_shunt_calibration()
+def get_calibration(use_cache=False):
+	"""Retrieve all calibration values from the device's flash memory, or from the calibration cache if use_cache is set and it holds the device's values."""
+	if dev is None: # Make sure it's connected
+		not_connected_errormessage()
+		return
+	cached_values = calibration_cache.lookup(dev.serial_number) if use_cache else None
+	if cached_values is not None:
+		show_calibration(*cached_values, source="the calibration cache")
+	else:
+		values = dev.read_calibration() # A single command with recent firmware
+		calibration_cache.store(dev.serial_number, *values)
+		show_calibration(*values, source="flash memory")
 
 def dac_calibrate():
-	"""Activate the automatic DAC1220 calibration function and retrieve the results."""
-	send_command(b'DACCAL', b'OK', "DAC calibration performed.")
-	get_dac_calibration()
+	"""Activate the automatic DAC1220 calibration function; the results are retrieved once it has finished (see dac_calibrate_poll())."""
+	if send_command(b'DACCAL', b'OK', "DAC calibration started."):
+		forget_cached_calibration()
+		deadline = timeit.default_timer()+engine.dac_calibration_timeout
+		QtCore.QTimer.singleShot(int(engine.dac_calibration_poll_interval*1e3), lambda: dac_calibrate_poll(deadline))
+
+def dac_calibrate_poll(deadline):
+	"""Check whether the DAC calibration has finished, without blocking the GUI in the meantime; give up once the host timer passes the deadline."""
+	if dev is None:
+		return # Disconnected in the meantime
+	if not dev.dac_calibration_finished():
+		if timeit.default_timer() > deadline:
+			log_message("DAC calibration did not finish.")
+			QtGui.QMessageBox.critical(mainwidget, "DAC calibration failed", "The DAC calibration did not finish within %d seconds. The calibration values have not been updated."%engine.dac_calibration_timeout)
+			return
+		QtCore.QTimer.singleShot(int(engine.dac_calibration_poll_interval*1e3), lambda: dac_calibrate_poll(deadline))
+		return
+	log_message("DAC calibration performed.")
+	get_calibration()
 
 def set_output(value_units_index, value):
 	"""Output data to the DAC; units can be either V (index 0), mA (index 1), or raw counts (index 2)."""
 	if value_units_index == 0:
-		send_command(b'DACSET '+decimal_to_dac_bytes(value/8.*2.**19+int(round(potential_offset/4.))), b'OK')
+		send_command(b'DACSET '+calibration.potential_to_dac_bytes(value), b'OK')
 	elif value_units_index == 1:
-		send_command(b'DACSET '+decimal_to_dac_bytes(value/(25./(shunt_calibration[currentrange]*100.**currentrange))*2.**19+int(round(current_offset/4.))), b'OK')
+		send_command(b'DACSET '+calibration.current_to_dac_bytes(value, currentrange), b'OK')
 	elif value_units_index == 2:
 		send_command(b'DACSET '+decimal_to_dac_bytes(value), b'OK')
 
@@ -556,31 +506,48 @@ def wait_for_adcread():
 		while timeit.default_timer() < time_of_last_adcread + busyloop_interval:
 			pass # Busy loop (this is the only way to get accurate timing on MS Windows)
 
-def read_potential_current():
-	"""Read the most recent potential and current values from the device's ADC."""
-	global potential, current, raw_potential, raw_current, time_of_last_adcread
-	wait_for_adcread()
-	time_of_last_adcread = timeit.default_timer()
-	dev.write(0x01,b'ADCREAD') # 0x01 = write address of EP1
-	response = bytes(dev.read(0x81,64)) # 0x81 = read address of EP1
-	if response != b'WAIT': # 'WAIT' is received if a conversion has not yet finished
+def read_potential_current(preceding_commands=None):
+	"""Read the most recent potential and current values from the device's ADC; return True if a new measurement was obtained. Commands in preceding_commands (replying "OK") are executed first, in the same USB transfer when polling."""
+	global potential, current, raw_potential, raw_current, time_of_last_adcread, sample_flags
+	preceding_commands = list(preceding_commands) if preceding_commands is not None else []
+	if streaming_enabled: # The device sends its conversions by itself, so just collect the next one
+		for command_string in preceding_commands:
+			send_command(command_string, b'OK')
+		while True:
+			if len(dev.samples) == 0:
+				return False # No new samples from the USB reader thread yet
+			sample = dev.samples.popleft() # Already scaled by the USB reader thread
+			raw_potential, raw_current, potential, current, sample_range, time_of_last_adcread, sample_flags = sample.raw_potential, sample.raw_current, sample.potential, sample.current, sample.range, sample.time, sample.flags
+			if not sample_flags & stream_flag_invalid:
+				break # Samples taken during a relay transition are dropped
+	else:
+		wait_for_adcread()
+		time_of_last_adcread = timeit.default_timer()
+		replies = dev.send_batch(preceding_commands+[b'ADCREAD'])
+		if len(replies) != len(preceding_commands)+1 or replies[-1] in (b'WAIT', b'BUSY'): # 'WAIT' is received if a conversion has not yet finished, 'BUSY' if the device is taking conversions by itself
+			return False
+		response = replies[-1]
 		raw_potential = twocomplement_to_decimal(response[0], response[1], response[2])
 		raw_current = twocomplement_to_decimal(response[3], response[4], response[5])
-		potential = (raw_potential-potential_offset)/2097152.*8. # Calculate potential in V, compensating for offset
-		current = (raw_current-current_offset)/2097152.*25./(shunt_calibration[currentrange]*100.**currentrange) # Calculate current in mA, taking current range into account and compensating for offset
-		potential_monitor.setText(potential_to_string(potential))
-		current_monitor.setText(current_to_string(currentrange, current))
-		if logging_enabled: # If enabled, all measurements are appended to an output file (even in idle mode)
-			try:
-				print("%.2f\t%e\t%e"%(time_of_last_adcread,potential,current*1e-3),file=open(hardware_log_filename.text(),'a',1)) # Output tab-separated data containing time (in s), potential (in V), and current (in A)
-			except:
-				QtGui.QMessageBox.critical(mainwidget, "Logging error!", "Logging error!")
-				hardware_log_checkbox.setChecked(False) # Disable logging in case of file errors
+		sample_range = currentrange
+		sample_flags = 0
+		potential = calibration.adc_to_potential(raw_potential)
+		current = calibration.adc_to_current(raw_current, sample_range)
+	potential_monitor.setText(potential_to_string(potential))
+	current_monitor.setText(current_to_string(sample_range, current))
+	if logging_enabled: # If enabled, all measurements are appended to a binary log file (even in idle mode)
+		try:
+			log_writer.add_record(time_of_last_adcread, raw_potential, raw_current, sample_range)
+		except:
+			QtGui.QMessageBox.critical(mainwidget, "Logging error!", "Logging error!")
+			hardware_log_checkbox.setChecked(False) # Disable logging in case of file errors
+	return True
 
 def idle_init():
 	"""Perform some necessary initialization before entering the Idle state."""
 	global potential_plot_curve, current_plot_curve, legend, state
 	plot_frame.clear()
+	pending_plot_updates.clear() # These curves have just been removed
 	try:
 		legend.scene().removeItem(legend) # Remove any previous legends
 	except AttributeError:
@@ -597,24 +564,70 @@ def idle_init():
 	state = States.Idle # Proceed to the Idle state
 
 def update_live_graph():
-	"""Add newly measured potential and current values to their respective buffers and update the plot curves."""
+	"""Add newly measured potential and current values to their respective buffers and schedule the plot curves for redrawing."""
 	last_potential_values.append(potential)
 	last_current_values.append(current)
 	last_raw_potential_values.append(raw_potential)
 	last_raw_current_values.append(raw_current)
-	xvalues = range(last_potential_values.maxlen-len(last_potential_values),last_potential_values.maxlen)
-	potential_plot_curve.setData(xvalues, list(last_potential_values))
-	current_plot_curve.setData(xvalues, list(last_current_values))
+	schedule_plot_update(potential_plot_curve, lambda: (live_graph_xvalues(), numpy.array(last_potential_values)))
+	schedule_plot_update(current_plot_curve, lambda: (live_graph_xvalues(), numpy.array(last_current_values)))
+
+def live_graph_xvalues():
+	"""Return the sample numbers of the values in the live graph buffers, such that the newest value is always at the right edge."""
+	return numpy.arange(last_potential_values.maxlen-len(last_potential_values),last_potential_values.maxlen)
+
+def schedule_plot_update(curve, get_data):
+	"""Mark a plot curve for redrawing with the (x, y) data returned by get_data; the data is only retrieved when refresh_plots() actually redraws the curve."""
+	pending_plot_updates[curve] = get_data
+
+def refresh_plots(force=False):
+	"""Redraw the plot curves that have new data, at most once every plot_refresh_interval unless forced."""
+	global last_plot_refresh
+	now = timeit.default_timer()
+	if len(pending_plot_updates) == 0 or (not force and now-last_plot_refresh < plot_refresh_interval):
+		return
+	last_plot_refresh = now
+	for curve, get_data in pending_plot_updates.items():
+		curve.setData(*get_data()) # Curves with more points than the plot is wide are drawn with min/max (peak) downsampling, see setDownsampling() below
+	pending_plot_updates.clear()
 
-def choose_file(file_entry_field, questionstring):
+def choose_file(file_entry_field, questionstring, file_filter="ASCII data (*.txt)"):
 	"""Open a file dialog and write the path of the selected file to a given entry field."""
 	filedialog = QtGui.QFileDialog()
-	file_entry_field.setText(filedialog.getSaveFileName(mainwidget, questionstring, "", "ASCII data (*.txt)",options=QtGui.QFileDialog.DontConfirmOverwrite))
+	file_entry_field.setText(filedialog.getSaveFileName(mainwidget, questionstring, "", file_filter,options=QtGui.QFileDialog.DontConfirmOverwrite))
 
 def toggle_logging(checkbox_state):
 	"""Enable or disable logging of measurements to a file based on the state of a checkbox (2 means checked)."""
-	global logging_enabled
-	logging_enabled = (checkbox_state == 2)
+	global logging_enabled, log_writer
+	if log_writer is not None:
+		try:
+			log_writer.close()
+		except IOError:
+			pass # The file already failed while logging
+		log_writer = None
+	logging_enabled = False
+	if checkbox_state == 2:
+		try:
+			log_writer = LogWriter(hardware_log_filename.text(), calibration)
+			logging_enabled = True
+		except IOError:
+			QtGui.QMessageBox.critical(mainwidget, "Logging error!", "Could not open the log file.")
+			hardware_log_checkbox.setChecked(False)
+
+def export_log():
+	"""Ask for a file name and convert the binary log file to tab-separated text."""
+	log_filename = hardware_log_filename.text()
+	if log_writer is not None:
+		log_writer.flush() # Include the records that are still buffered
+	filedialog = QtGui.QFileDialog()
+	text_filename = filedialog.getSaveFileName(mainwidget, "Choose where to save the exported log data", "", "ASCII data (*.txt)")
+	if text_filename == "":
+		return
+	try:
+		numrecords = export_log_to_text(log_filename, text_filename)
+		log_message("Exported %d measurements from %s to %s"%(numrecords, log_filename, text_filename))
+	except IOError:
+		QtGui.QMessageBox.critical(mainwidget, "Export error!", "Could not export the log file.")
 
 def cv_getparams():
 	"""Retrieve the CV parameters from the GUI input fields and store them in a global dictionary. If succesful, return True."""
@@ -678,8 +691,7 @@ def cv_start():
 	"""Initialize the CV measurement."""
 	global cv_time_data, cv_potential_data, cv_current_data, cv_plot_curve, cv_outputfile, state, skipcounter
 	if check_state([States.Idle,States.Stationary_Graph]) and cv_getparams() and cv_validate_parameters() and validate_file(cv_parameters['filename']):
-		cv_outputfile = open(cv_parameters['filename'], 'w', 1) # 1 means line-buffered
-		cv_outputfile.write("Elapsed time(s)\tPotential(V)\tCurrent(A)\n")
+		cv_outputfile = OutputWriter(cv_parameters['filename'], "Elapsed time(s)\tPotential(V)\tCurrent(A)")
 		set_output(0, cv_parameters['startpot'])
 		set_control_mode(False) # Potentiostatic control
 		hardware_manual_control_range_dropdown.setCurrentIndex(0) # Start at highest current range
@@ -712,35 +724,65 @@ def cv_start():
 		plot_frame.setLabel('left', 'Current', units="A")
 		cv_plot_curve = plot_frame.plot(pen='y') # Plot CV in yellow
 		log_message("CV measurement started. Saving to: %s"%cv_parameters['filename'])
+		cv_parameters['device_sweep'] = streaming_enabled # With streaming firmware, the device generates the sweep by itself
+		if cv_parameters['device_sweep']:
+			set_device_autorange(True)
+			cv_start_device_sweep()
+		else:
+			cv_parameters['waveform'] = CVWaveform(calibration, cv_parameters['startpot'], cv_parameters['stoppot'], cv_parameters['ubound'], cv_parameters['lbound'], cv_parameters['scanrate'], cv_parameters['numcycles']) # DAC codes for the whole sweep, looked up in cv_update()
 		state = States.Measuring_CV
 		skipcounter = 2 # Skip first two data points to suppress artifacts
 		cv_parameters['starttime'] = timeit.default_timer()
 
+def cv_start_device_sweep():
+	"""Upload the CV parameters to the device's sweep engine, which then steps the DAC by itself."""
+	send_command(cv_sweep_command(calibration, cv_parameters['startpot'], cv_parameters['ubound'], cv_parameters['lbound'], cv_parameters['stoppot'], cv_parameters['scanrate'], cv_parameters['numcycles']), b'OK')
+	cv_parameters['device_sweep_started'] = False # Samples taken before the sweep started may still arrive, as the device only ships them once a sample with different flags is stored
+
 def cv_update():
 	"""Add a new data point to the CV measurement (should be called regularly)."""
 	global state, skipcounter
-	elapsed_time = timeit.default_timer()-cv_parameters['starttime']
-	cv_output = cv_sweep(elapsed_time, cv_parameters['startpot'], cv_parameters['stoppot'], cv_parameters['ubound'], cv_parameters['lbound'], cv_parameters['scanrate'], cv_parameters['numcycles'])
-	if cv_output == None: # This signifies the end of the CV scan
-		cv_stop(interrupted=False)
+	if cv_parameters['device_sweep']: # The device steps the DAC, so only the streamed samples need to be processed
+		if not read_potential_current():
+			return # No new measurement available yet
+		if not cv_parameters['device_sweep_started']:
+			cv_parameters['device_sweep_started'] = bool(sample_flags & stream_flag_sweep)
+			if not cv_parameters['device_sweep_started']:
+				return # Taken before the sweep started
+		if not sample_flags & stream_flag_sweep: # This signifies the end of the CV scan
+			cv_stop(interrupted=False)
+			return
+		elapsed_time = time_of_last_adcread-cv_parameters['starttime']
 	else:
-		set_output(0, cv_output) # Output a new potential value
-		read_potential_current() # Read new potential and current
-		if skipcounter == 0: # Process new measurements
-			cv_time_data.add_sample(elapsed_time)
-			cv_potential_data.add_sample(potential)
-			cv_current_data.add_sample(1e-3*current) # Convert from mA to A
-			if len(cv_time_data.samples) == 0 and len(cv_time_data.averagebuffer) > 0: # Check if a new average was just calculated
-				cv_outputfile.write("%e\t%e\t%e\n"%(cv_time_data.averagebuffer[-1],cv_potential_data.averagebuffer[-1],cv_current_data.averagebuffer[-1])) # Write it out
-				cv_plot_curve.setData(cv_potential_data.averagebuffer,cv_current_data.averagebuffer) # Update the graph
+		elapsed_time = timeit.default_timer()-cv_parameters['starttime']
+		cv_index = cv_parameters['waveform'].index_at(elapsed_time)
+		if cv_index is None: # This signifies the end of the CV scan
+			cv_stop(interrupted=False)
+			return
+		if not read_potential_current([b'DACSET '+cv_parameters['waveform'].dac_bytes(cv_index)]): # Output a new potential value, then read new potential and current (in a single USB transfer)
+			return # No new measurement available yet
+	if skipcounter == 0: # Process new measurements
+		cv_time_data.add_sample(elapsed_time)
+		cv_potential_data.add_sample(potential)
+		cv_current_data.add_sample(1e-3*current) # Convert from mA to A
+		if len(cv_time_data.samples) == 0 and len(cv_time_data.averagebuffer) > 0: # Check if a new average was just calculated
+			cv_outputfile.write(cv_time_data.averagebuffer[-1],cv_potential_data.averagebuffer[-1],cv_current_data.averagebuffer[-1]) # Write it out
+			schedule_plot_update(cv_plot_curve, lambda: (cv_potential_data.averagebuffer,cv_current_data.averagebuffer)) # Update the graph
+		if cv_parameters['device_sweep']: # The device switches the current range by itself and tags each sample with it
+			if sample_flags%4 != currentrange:
+				track_current_range(sample_flags%4)
+		else:
 			skipcounter = auto_current_range() # Update the graph
-		else: # Wait until the required number of data points is skipped
-			skipcounter -= 1
+	else: # Wait until the required number of data points is skipped
+		skipcounter -= 1
 
 def cv_stop(interrupted=True):
 	"""Finish the CV measurement."""
 	global state
 	if check_state([States.Measuring_CV]):
+		if cv_parameters['device_sweep']:
+			send_command(b'CVSTOP', b'OK') # Stop the device's sweep engine in case it is still running
+			set_device_autorange(False)
 		set_cell_status(False) # Cell off
 		cv_outputfile.close()
 		charge_arr = charge_from_cv(cv_time_data.averagebuffer, cv_current_data.averagebuffer) # Integrate current between zero crossings to produce list of inserted/extracted charges
@@ -755,16 +797,8 @@ def cv_preview():
 	"""Generate a preview of the CV potential profile in the plot window, based on the CV parameters currently entered in the GUI."""
 	global state
 	if check_state([States.Idle,States.Stationary_Graph]) and cv_getparams() and cv_validate_parameters():
-		time_arr = [] # Initialize time array
-		potential_arr = [] # Initialize potential array
-		timeval = 0. # Initialize elapsed time
 		timestep = abs((cv_parameters['ubound']-cv_parameters['lbound'])/100./cv_parameters['scanrate']) # Automatic timestep calculation, resulting in 100 potential steps between lower and upper bound
-		cv_val = cv_sweep(timeval, cv_parameters['startpot'], cv_parameters['stoppot'], cv_parameters['ubound'], cv_parameters['lbound'], cv_parameters['scanrate'], cv_parameters['numcycles'])
-		while cv_val != None: # Fill time and potential arrays with calculated values, loop until end of CV profile
-			time_arr.append(timeval)
-			potential_arr.append(cv_val)
-			timeval += timestep
-			cv_val = cv_sweep(timeval, cv_parameters['startpot'], cv_parameters['stoppot'], cv_parameters['ubound'], cv_parameters['lbound'], cv_parameters['scanrate'], cv_parameters['numcycles'])
+		waveform = CVWaveform(calibration, cv_parameters['startpot'], cv_parameters['stoppot'], cv_parameters['ubound'], cv_parameters['lbound'], cv_parameters['scanrate'], cv_parameters['numcycles'], timestep) # Computes the whole profile at once
 		try:
 			legend.scene().removeItem(legend)
 		except AttributeError:
@@ -773,7 +807,7 @@ def cv_preview():
 		plot_frame.enableAutoRange()
 		plot_frame.setLabel('bottom', 'Time', units='s')
 		plot_frame.setLabel('left', 'Potential', units='V')
-		plot_frame.plot(time_arr, potential_arr, pen='g')
+		plot_frame.plot(waveform.time, waveform.potential, pen='g')
 		preview_cancel_button.show()
 		state = States.Stationary_Graph # Keep displaying the CV preview until the user clicks a button
 		
@@ -827,27 +861,31 @@ def cd_validate_parameters():
 
 def cd_start():
 	"""Initialize the charge/discharge measurement."""
-	global cd_charges, cd_currentsetpoint, cd_starttime, cd_currentcycle, cd_time_data, cd_potential_data, cd_current_data, cd_plot_curves, cd_outputfile_raw, cd_outputfile_capacities, state
+	global cd_charges, cd_currentsetpoint, cd_starttime, cd_currentcycle, cd_time_data, cd_potential_data, cd_current_data, cd_charge_data, cd_plot_curves, cd_outputfile_raw, cd_outputfile_capacities, state
 	if check_state([States.Idle,States.Stationary_Graph]) and cd_getparams() and cd_validate_parameters() and validate_file(cd_parameters['filename']):
 		cd_currentcycle = 1
 		cd_charges = []
 		cd_plot_curves = []
-		cd_outputfile_raw = open(cd_parameters['filename'], 'w', 1) # This file will contain time, potential, and current data
-		cd_outputfile_raw.write("Elapsed time(s)\tPotential(V)\tCurrent(A)\n")
+		cd_outputfile_raw = OutputWriter(cd_parameters['filename'], "Elapsed time(s)\tPotential(V)\tCurrent(A)") # This file will contain time, potential, and current data
 		base, extension = os.path.splitext(cd_parameters['filename'])
-		cd_outputfile_capacities = open(base+'_capacities'+extension, 'w', 1) # This file will contain capacity data for each cycle
-		cd_outputfile_capacities.write("Cycle number\tCharge capacity (Ah)\tDischarge capacity (Ah)\n")
+		cd_outputfile_capacities = OutputWriter(base+'_capacities'+extension, "Cycle number\tCharge capacity (Ah)\tDischarge capacity (Ah)", ["%d","%e","%e"]) # This file will contain capacity data for each cycle
 		cd_currentsetpoint = cd_parameters['chargecurrent']
+		set_stream_latency(stream_latency_batched) # Cut-off checks can tolerate some latency, so let the device pack samples into full frames
 		hardware_manual_control_range_dropdown.setCurrentIndex(current_range_from_current(cd_currentsetpoint)) # Determine the proper current range for the current setpoint
 		set_current_range() # Set new current range
 		set_output(1, cd_currentsetpoint) # Set current to setpoint
 		set_control_mode(True) # Galvanostatic control
 		time.sleep(.2) # Allow DAC some time to settle
 		cd_starttime = timeit.default_timer()
-		cd_time_data = AverageBuffer(cd_parameters['numsamples']) # Holds averaged data for elapsed time
-		cd_potential_data = AverageBuffer(cd_parameters['numsamples']) # Holds averaged data for potential
-		cd_current_data = AverageBuffer(cd_parameters['numsamples']) # Holds averaged data for current
+		numsamples = set_stream_decimation(cd_parameters['numsamples']) # With streaming firmware, the device does the averaging
+		cd_time_data = AverageBuffer(numsamples) # Holds averaged data for elapsed time
+		cd_potential_data = AverageBuffer(numsamples) # Holds averaged data for potential
+		cd_current_data = AverageBuffer(numsamples) # Holds averaged data for current
+		cd_charge_data = ChargeBuffer() # Holds the cumulative charge at each averaged data point
 		set_cell_status(True) # Cell on
+		cd_parameters['device_control'] = streaming_enabled # With streaming firmware, the device checks the potential limits and switches the current by itself
+		if cd_parameters['device_control']:
+			device_cd_start([cd_parameters['chargecurrent'], cd_parameters['dischargecurrent']], cd_parameters['numcycles'], cd_parameters['ubound'], cd_parameters['lbound'], True)
 		preview_cancel_button.hide()
 		try: # Set up the plotting area
 			legend.scene().removeItem(legend)
@@ -862,43 +900,89 @@ def cd_start():
 		cd_current_cycle_entry.setText("%d"%cd_currentcycle) # Indicate the current cycle number
 		state = States.Measuring_CD
 
+def device_cd_start(currents, numhalfcycles, ubound, lbound, cell_off_when_done):
+	"""Hand galvanostatic cycling over to the device, which switches between the two currents by itself whenever a potential limit is crossed; the first current must already be applied."""
+	global cd_device_phase, cd_device_started
+	send_command(cd_start_command(calibration, currents, numhalfcycles, ubound, lbound, currentrange, cell_off_when_done), b'OK')
+	cd_device_phase = 0
+	cd_device_started = False # Samples taken before the controller started may still arrive (see device_cd_stale_sample())
+
+def device_cd_stale_sample():
+	"""Return True if the last sample was taken before the device's charge/discharge controller started. The device only ships a frame of such samples once the first sample with different flags is stored, which is after its reply to CDSTART, so these samples cannot be discarded when the command is sent."""
+	global cd_device_started
+	if not cd_device_started:
+		cd_device_started = bool(sample_flags & stream_flag_cd)
+	return not cd_device_started
+
+def device_cutoff_reached():
+	"""Return True if the flags of the last sample show that the device's charge/discharge controller has crossed a potential limit since the previous sample."""
+	global cd_device_phase
+	if not sample_flags & stream_flag_cd: # The controller has finished its last half cycle
+		return True
+	phase = 1 if sample_flags & stream_flag_cd_phase else 0
+	if phase == cd_device_phase:
+		return False
+	cd_device_phase = phase
+	return True
+
+def cd_next_half_cycle():
+	"""Switch to the next half cycle of the charge/discharge measurement after a potential cut-off has been reached."""
+	global cd_currentsetpoint, cd_currentcycle
+	if cd_currentsetpoint == cd_parameters['chargecurrent']: # Switch from the discharge phase to the charge phase or vice versa
+		cd_currentsetpoint = cd_parameters['dischargecurrent']
+	else:
+		cd_currentsetpoint = cd_parameters['chargecurrent']
+	if cd_parameters['device_control']: # The device has already switched the current
+		if cd_currentcycle < cd_parameters['numcycles']:
+			track_current_range(current_range_from_current(cd_currentsetpoint))
+	else:
+		hardware_manual_control_range_dropdown.setCurrentIndex(current_range_from_current(cd_currentsetpoint)) # Determine the proper current range for the new setpoint
+		set_current_range() # Set new current range
+		set_output(1, cd_currentsetpoint)  # Set current to setpoint
+	refresh_plots(force=True) # Draw the last points of the finished half cycle before its buffers are cleared
+	cd_plot_curves.append(plot_frame.plot(pen='y')) # Start a new plot curve and append it to the plot area (keeping the old ones as well)
+	cd_charges.append(abs(cd_charge_data.charge)) # Cumulative charge in Ah
+	if cd_currentcycle % 2 == 0: # Write out the charge and discharge capacities after both a charge and discharge phase (i.e. after cycle 2, 4, 6...)
+		cd_outputfile_capacities.write(cd_currentcycle//2,cd_charges[cd_currentcycle-2],cd_charges[cd_currentcycle-1])
+	for data in [cd_time_data, cd_potential_data, cd_current_data, cd_charge_data]: # Clear average buffers to prepare them for the next cycle
+		data.clear()
+	cd_currentcycle += 1 # Next cycle
+	cd_current_cycle_entry.setText("%d"%cd_currentcycle) # Indicate next cycle
+
 def cd_update():
 	"""Add a new data point to the charge/discharge measurement (should be called regularly)."""
-	global cd_currentsetpoint, cd_currentcycle, state
-	elapsed_time = timeit.default_timer()-cd_starttime
+	global state
 	if cd_currentcycle > cd_parameters['numcycles']: # End of charge/discharge measurements
 		cd_stop(interrupted=False)
 	else: # Continue charge/discharge measurement process
-		read_potential_current() # Read new potential and current
+		if not read_potential_current(): # Read new potential and current
+			return # No new measurement available yet
+		if cd_parameters['device_control'] and device_cd_stale_sample():
+			return # Taken before the controller started
+		if cd_parameters['device_control'] and device_cutoff_reached(): # The device switched phases before taking this sample
+			cd_next_half_cycle()
+			if cd_currentcycle > cd_parameters['numcycles']:
+				return # The sample was taken after the last half cycle
+		elapsed_time = time_of_last_adcread-cd_starttime
 		cd_time_data.add_sample(elapsed_time)
 		cd_potential_data.add_sample(potential)
 		cd_current_data.add_sample(1e-3*current) # Convert mA to A
 		if len(cd_time_data.samples) == 0 and len(cd_time_data.averagebuffer) > 0: # A new average was just calculated
-			cd_outputfile_raw.write("%e\t%e\t%e\n"%(cd_time_data.averagebuffer[-1],cd_potential_data.averagebuffer[-1],cd_current_data.averagebuffer[-1])) # Write it out
-			charge = numpy.abs(scipy.integrate.cumtrapz(cd_current_data.averagebuffer,cd_time_data.averagebuffer,initial=0.)/3600.) # Cumulative charge in Ah
-			cd_plot_curves[cd_currentcycle-1].setData(charge,cd_potential_data.averagebuffer) # Update the graph
-		if (cd_currentsetpoint > 0 and potential > cd_parameters['ubound']) or (cd_currentsetpoint < 0 and potential < cd_parameters['lbound']): # A potential cut-off has been reached
-			if cd_currentsetpoint == cd_parameters['chargecurrent']: # Switch from the discharge phase to the charge phase or vice versa
-				cd_currentsetpoint = cd_parameters['dischargecurrent']
-			else:
-				cd_currentsetpoint = cd_parameters['chargecurrent']
-			hardware_manual_control_range_dropdown.setCurrentIndex(current_range_from_current(cd_currentsetpoint)) # Determine the proper current range for the new setpoint
-			set_current_range() # Set new current range
-			set_output(1, cd_currentsetpoint)  # Set current to setpoint
-			cd_plot_curves.append(plot_frame.plot(pen='y')) # Start a new plot curve and append it to the plot area (keeping the old ones as well)
-			cd_charges.append(numpy.abs(numpy.trapz(cd_current_data.averagebuffer,cd_time_data.averagebuffer)/3600.)) # Cumulative charge in Ah
-			if cd_currentcycle % 2 == 0: # Write out the charge and discharge capacities after both a charge and discharge phase (i.e. after cycle 2, 4, 6...)
-				cd_outputfile_capacities.write("%d\t%e\t%e\n"%(cd_currentcycle/2,cd_charges[cd_currentcycle-2],cd_charges[cd_currentcycle-1]))
-			for data in [cd_time_data, cd_potential_data, cd_current_data]: # Clear average buffers to prepare them for the next cycle
-				data.clear()
-			cd_currentcycle += 1 # Next cycle
-			cd_current_cycle_entry.setText("%d"%cd_currentcycle) # Indicate next cycle
+			cd_outputfile_raw.write(cd_time_data.averagebuffer[-1],cd_potential_data.averagebuffer[-1],cd_current_data.averagebuffer[-1]) # Write it out
+			cd_charge_data.add_point(cd_time_data.averagebuffer[-1],cd_current_data.averagebuffer[-1]) # Update the cumulative charge
+			schedule_plot_update(cd_plot_curves[cd_currentcycle-1], lambda: (cd_charge_data.data(),cd_potential_data.averagebuffer)) # Update the graph
+		if not cd_parameters['device_control'] and ((cd_currentsetpoint > 0 and potential > cd_parameters['ubound']) or (cd_currentsetpoint < 0 and potential < cd_parameters['lbound'])): # A potential cut-off has been reached
+			cd_next_half_cycle()
 
 def cd_stop(interrupted=True):
 	"""Finish the charge/discharge measurement."""
 	global state
 	if check_state([States.Measuring_CD]):
+		if cd_parameters['device_control']:
+			send_command(b'CDSTOP', b'OK') # Stop the device from switching the current by itself
 		set_cell_status(False) # Cell off
+		set_stream_latency(engine.stream_latency)
+		set_stream_decimation(1)
 		cd_outputfile_raw.close()
 		cd_outputfile_capacities.close()
 		if interrupted:
@@ -941,29 +1025,32 @@ def rate_validate_parameters():
 
 def rate_start():
 	"""Initialize the rate testing measurement."""
-	global state, crate_index, rate_halfcycle_countdown, rate_chg_charges, rate_dis_charges, rate_outputfile_raw, rate_outputfile_capacities, rate_starttime, rate_time_data, rate_potential_data, rate_current_data, rate_plot_scatter_chg, rate_plot_scatter_dis, legend
+	global state, crate_index, rate_halfcycle_countdown, rate_chg_charges, rate_dis_charges, rate_outputfile_raw, rate_outputfile_capacities, rate_starttime, rate_time_data, rate_potential_data, rate_current_data, rate_charge_data, rate_plot_scatter_chg, rate_plot_scatter_dis, legend
 	if check_state([States.Idle,States.Stationary_Graph]) and rate_getparams() and rate_validate_parameters() and validate_file(rate_parameters['filename']):
 		crate_index = 0 # Index in the list of C-rates
 		rate_halfcycle_countdown = 2*rate_parameters['numcycles'] # Holds amount of remaining half cycles
 		rate_chg_charges = [] # List of measured charge capacities
 		rate_dis_charges = [] # List of measured discharge capacities
-		rate_outputfile_raw = open(rate_parameters['filename'], 'w', 1) # This file will contain time, potential, and current data
-		rate_outputfile_raw.write("Elapsed time(s)\tPotential(V)\tCurrent(A)\n")
+		rate_outputfile_raw = OutputWriter(rate_parameters['filename'], "Elapsed time(s)\tPotential(V)\tCurrent(A)") # This file will contain time, potential, and current data
 		base, extension = os.path.splitext(rate_parameters['filename'])
-		rate_outputfile_capacities = open(base+'_capacities'+extension, 'w', 1) # This file will contain capacity data for each C-rate
-		rate_outputfile_capacities.write("C-rate\tCharge capacity (Ah)\tDischarge capacity (Ah)\n")
+		rate_outputfile_capacities = OutputWriter(base+'_capacities'+extension, "C-rate\tCharge capacity (Ah)\tDischarge capacity (Ah)") # This file will contain capacity data for each C-rate
 		rate_current = rate_parameters['currents'][crate_index] if rate_halfcycle_countdown%2 == 0 else -rate_parameters['currents'][crate_index] # Apply positive current for odd half cycles (charge phase) and negative current for even half cycles (discharge phase)
+		set_stream_latency(stream_latency_batched) # Cut-off checks can tolerate some latency, so let the device pack samples into full frames
 		hardware_manual_control_range_dropdown.setCurrentIndex(current_range_from_current(rate_current)) # Determine the proper current range for the current setpoint
 		set_current_range()  # Set new current range
 		set_output(1, rate_current) # Set current to setpoint
 		set_control_mode(True) # Galvanostatic control
 		time.sleep(.2) # Allow DAC some time to settle
 		rate_starttime = timeit.default_timer()
-		numsamples = max(1,int(36./rate_parameters['crates'][crate_index]))
+		numsamples = set_stream_decimation(max(1,int(36./rate_parameters['crates'][crate_index]))) # With streaming firmware, the device does the averaging
 		rate_time_data = AverageBuffer(numsamples) # Holds averaged data for elapsed time
 		rate_potential_data = AverageBuffer(numsamples) # Holds averaged data for potential
 		rate_current_data = AverageBuffer(numsamples) # Holds averaged data for current
+		rate_charge_data = ChargeBuffer() # Holds the cumulative charge at each averaged data point
 		set_cell_status(True) # Cell on
+		rate_parameters['device_control'] = streaming_enabled # With streaming firmware, the device checks the potential limits and switches the current by itself
+		if rate_parameters['device_control']:
+			rate_device_cd_start()
 		preview_cancel_button.hide()
 		try: # Set up the plotting area
 			legend.scene().removeItem(legend)
@@ -980,51 +1067,77 @@ def rate_start():
 		rate_current_crate_entry.setText("%d"%rate_parameters['crates'][crate_index]) # Indicate the current C-rate
 		state = States.Measuring_Rate
 
+def rate_device_cd_start():
+	"""Let the device cycle between the positive and negative current of the present C-rate; it applies zero current after the last half cycle."""
+	device_cd_start([rate_parameters['currents'][crate_index], -rate_parameters['currents'][crate_index]], 2*rate_parameters['numcycles'], rate_parameters['ubound'], rate_parameters['lbound'], False)
+
+def rate_next_half_cycle():
+	"""Switch to the next half cycle (and, if needed, the next C-rate) after a potential cut-off has been reached; return True if the measurement has finished."""
+	global crate_index, rate_halfcycle_countdown
+	new_crate = False
+	rate_halfcycle_countdown -= 1
+	if rate_halfcycle_countdown == 1: # Last charge cycle for this C-rate, so calculate and plot the charge capacity
+		charge = abs(rate_charge_data.charge) # Charge in Ah
+		rate_chg_charges.append(charge)
+		rate_plot_scatter_chg.setData(rate_parameters['crates'][0:crate_index+1], rate_chg_charges)
+	elif rate_halfcycle_countdown == 0: # Last discharge cycle for this C-rate, so calculate and plot the discharge capacity, and go to the next C-rate
+		charge = abs(rate_charge_data.charge) # Charge in Ah
+		rate_dis_charges.append(charge)
+		rate_plot_scatter_dis.setData(rate_parameters['crates'][0:crate_index+1], rate_dis_charges)
+		rate_outputfile_capacities.write(rate_parameters['crates'][crate_index],rate_chg_charges[-1],rate_dis_charges[-1])
+		if crate_index == len(rate_parameters['crates'])-1: # Last C-rate was measured
+			rate_stop(interrupted=False)
+			return True
+		else: # New C-rate
+			crate_index += 1
+			rate_halfcycle_countdown = 2*rate_parameters['numcycles'] # Set the amount of remaining half cycles for the new C-rate
+			if not rate_parameters['device_control']: # The device has already applied zero current
+				set_output(1, 0.) # Set zero current while range switching
+			hardware_manual_control_range_dropdown.setCurrentIndex(current_range_from_current(rate_parameters['currents'][crate_index])) # Determine the proper current range for the new setpoint
+			set_current_range() # Set new current range
+			numsamples = set_stream_decimation(max(1,int(36./rate_parameters['crates'][crate_index]))) # Set an appropriate amount of samples to average for the new C-rate; results in approx. 1000 points per curve
+			for data in [rate_time_data, rate_potential_data, rate_current_data]:
+				data.number_of_samples_to_average = numsamples
+			new_crate = True
+	if new_crate or not rate_parameters['device_control']: # Within a C-rate, the device switches the current by itself
+		rate_current = rate_parameters['currents'][crate_index] if rate_halfcycle_countdown%2 == 0 else -rate_parameters['currents'][crate_index] # Apply positive current for odd half cycles (charge phase) and negative current for even half cycles (discharge phase)
+		set_output(1, rate_current) # Set current to setpoint
+		if rate_parameters['device_control']:
+			rate_device_cd_start()
+	for data in [rate_time_data, rate_potential_data, rate_current_data, rate_charge_data]: # Clear average buffers to prepare them for the next cycle
+		data.clear()
+	rate_current_crate_entry.setText("%d"%rate_parameters['crates'][crate_index]) # Indicate the next C-rate
+	return False
+
 def rate_update():
 	"""Add a new data point to the rate testing measurement (should be called regularly)."""
-	global state, crate_index, rate_halfcycle_countdown
-	elapsed_time = timeit.default_timer()-rate_starttime
-	read_potential_current()
+	if not read_potential_current():
+		return # No new measurement available yet
+	if rate_parameters['device_control'] and device_cd_stale_sample():
+		return # Taken before the controller started
+	if rate_parameters['device_control'] and device_cutoff_reached(): # The device switched phases before taking this sample
+		if rate_next_half_cycle() or rate_halfcycle_countdown == 2*rate_parameters['numcycles']:
+			return # The measurement has finished, or the sample was taken before the next C-rate started
+	elapsed_time = time_of_last_adcread-rate_starttime
 	rate_time_data.add_sample(elapsed_time)
 	rate_potential_data.add_sample(potential)
 	rate_current_data.add_sample(1e-3*current) # Convert mA to A
 	if len(rate_time_data.samples) == 0 and len(rate_time_data.averagebuffer) > 0: # A new average was just calculated
-		rate_outputfile_raw.write("%e\t%e\t%e\n"%(rate_time_data.averagebuffer[-1],rate_potential_data.averagebuffer[-1],rate_current_data.averagebuffer[-1])) # Write it out
-	if (rate_halfcycle_countdown%2 == 0 and potential > rate_parameters['ubound']) or (rate_halfcycle_countdown%2 != 0 and potential < rate_parameters['lbound']): # A potential cut-off has been reached
-		rate_halfcycle_countdown -= 1
-		if rate_halfcycle_countdown == 1: # Last charge cycle for this C-rate, so calculate and plot the charge capacity
-			charge = numpy.abs(scipy.integrate.trapz(rate_current_data.averagebuffer,rate_time_data.averagebuffer)/3600.) # Charge in Ah
-			rate_chg_charges.append(charge)
-			rate_plot_scatter_chg.setData(rate_parameters['crates'][0:crate_index+1], rate_chg_charges)
-		elif rate_halfcycle_countdown == 0: # Last discharge cycle for this C-rate, so calculate and plot the discharge capacity, and go to the next C-rate
-			charge = numpy.abs(scipy.integrate.trapz(rate_current_data.averagebuffer,rate_time_data.averagebuffer)/3600.) # Charge in Ah
-			rate_dis_charges.append(charge)
-			rate_plot_scatter_dis.setData(rate_parameters['crates'][0:crate_index+1], rate_dis_charges)
-			rate_outputfile_capacities.write("%e\t%e\t%e\n"%(rate_parameters['crates'][crate_index],rate_chg_charges[-1],rate_dis_charges[-1]))
-			if crate_index == len(rate_parameters['crates'])-1: # Last C-rate was measured
-				rate_stop(interrupted=False)
-				return
-			else: # New C-rate
-				crate_index += 1
-				rate_halfcycle_countdown = 2*rate_parameters['numcycles'] # Set the amount of remaining half cycles for the new C-rate
-				set_output(1, 0.) # Set zero current while range switching
-				hardware_manual_control_range_dropdown.setCurrentIndex(current_range_from_current(rate_parameters['currents'][crate_index])) # Determine the proper current range for the new setpoint
-				set_current_range() # Set new current range
-				numsamples = max(1,int(36./rate_parameters['crates'][crate_index])) # Set an appropriate amount of samples to average for the new C-rate; results in approx. 1000 points per curve
-				for data in [rate_time_data, rate_potential_data, rate_current_data]:
-					data.number_of_samples_to_average = numsamples
-		rate_current = rate_parameters['currents'][crate_index] if rate_halfcycle_countdown%2 == 0 else -rate_parameters['currents'][crate_index] # Apply positive current for odd half cycles (charge phase) and negative current for even half cycles (discharge phase)
-		set_output(1, rate_current) # Set current to setpoint
-		for data in [rate_time_data, rate_potential_data, rate_current_data]: # Clear average buffers to prepare them for the next cycle
-			data.clear()
-		rate_current_crate_entry.setText("%d"%rate_parameters['crates'][crate_index]) # Indicate the next C-rate
+		rate_outputfile_raw.write(rate_time_data.averagebuffer[-1],rate_potential_data.averagebuffer[-1],rate_current_data.averagebuffer[-1]) # Write it out
+		rate_charge_data.add_point(rate_time_data.averagebuffer[-1],rate_current_data.averagebuffer[-1]) # Update the charge of this half cycle
+	if not rate_parameters['device_control'] and ((rate_halfcycle_countdown%2 == 0 and potential > rate_parameters['ubound']) or (rate_halfcycle_countdown%2 != 0 and potential < rate_parameters['lbound'])): # A potential cut-off has been reached
+		rate_next_half_cycle()
 
 def rate_stop(interrupted=True):
 	"""Finish the rate testing measurement."""
 	global state
 	if check_state([States.Measuring_Rate]):
 		state = States.Idle_Init
+		if rate_parameters['device_control']:
+			send_command(b'CDSTOP', b'OK') # Stop the device from switching the current by itself
 		set_cell_status(False) # Cell off
+		set_stream_latency(engine.stream_latency)
+		set_stream_decimation(1)
 		rate_outputfile_raw.close()
 		rate_outputfile_capacities.close()
 		if interrupted:
@@ -1036,6 +1149,10 @@ def rate_stop(interrupted=True):
 		preview_cancel_button.show()
 
 # Set up the GUI - Main Window
+if "--emulate" in sys.argv[1:]:
+	import tdstatv3_emulator
+	emulated_devices.append(tdstatv3_emulator.EmulatedDevice())
+
 app = QtGui.QApplication([])
 win = QtGui.QMainWindow()
 win.setGeometry(300,300,1024,700)
@@ -1066,6 +1183,8 @@ mode_display_frame.addWidget(control_mode_monitor_box)
 mode_display_frame.addWidget(current_range_monitor_box)
 pyqtgraph.setConfigOptions(foreground="#e5e5e5",background="#00304f")
 plot_frame = pyqtgraph.PlotWidget()
+plot_frame.setDownsampling(auto=True, mode='peak') # Long curves are reduced to the minimum and maximum value per pixel column before drawing
+plot_frame.setClipToView(True) # Points outside of the visible range are not drawn
 
 display_plot_frame = QtGui.QVBoxLayout()
 display_plot_frame.setSpacing(0)
@@ -1104,6 +1223,8 @@ hardware_usb_vid = make_label_entry(hardware_usb_vid_pid_layout, "VID")
 hardware_usb_vid.setText(usb_vid)
 hardware_usb_pid = make_label_entry(hardware_usb_vid_pid_layout, "PID")
 hardware_usb_pid.setText(usb_pid)
+hardware_usb_serial = make_label_entry(hardware_usb_vid_pid_layout, "Serial")
+hardware_usb_serial.setText(usb_serial)
 hardware_usb_connectButton = QtGui.QPushButton("Connect")
 hardware_usb_connectButton.clicked.connect(connect_disconnect_usb)
 hardware_usb_box_layout.addWidget(hardware_usb_connectButton)
@@ -1117,6 +1238,12 @@ hardware_device_info_box_layout = QtGui.QVBoxLayout()
 hardware_device_info_box.setLayout(hardware_device_info_box_layout)
 hardware_device_info_text = QtGui.QLabel("Manufacturer: \nProduct: \nSerial #: ")
 hardware_device_info_box_layout.addWidget(hardware_device_info_text)
+hardware_device_serial_layout = QtGui.QHBoxLayout()
+hardware_device_info_box_layout.addLayout(hardware_device_serial_layout)
+hardware_device_serial_entry = make_label_entry(hardware_device_serial_layout, "New serial #")
+hardware_device_serial_set_button = QtGui.QPushButton("Set")
+hardware_device_serial_set_button.clicked.connect(set_serial_number)
+hardware_device_serial_layout.addWidget(hardware_device_serial_set_button)
 hardware_device_info_box_layout.setSpacing(5)
 hardware_device_info_box_layout.setContentsMargins(3,9,3,3)
 hardware_vbox.addWidget(hardware_device_info_box)
@@ -1156,7 +1283,7 @@ hardware_calibration_box_layout.addLayout(hardware_calibration_shunt_resistor_la
 hardware_calibration_shuntvalues = [make_label_entry(hardware_calibration_shunt_resistor_layout, "R%d"%i) for i in range(1,4)]
 for i in range(0,3):
 	hardware_calibration_shuntvalues[i].editingFinished.connect(shunt_calibration_changed_callback)
-	hardware_calibration_shuntvalues[i].setText("%.4f"%shunt_calibration[i])
+	hardware_calibration_shuntvalues[i].setText("%.4f"%calibration.shunt_calibration[i])
 
 hardware_calibration_button_layout = QtGui.QHBoxLayout()
 hardware_calibration_get_button = QtGui.QPushButton("Load from device")
@@ -1234,8 +1361,11 @@ hardware_log_filename = QtGui.QLineEdit()
 hardware_log_box_layout.addWidget(hardware_log_filename)
 hardware_log_choose_button = QtGui.QPushButton("...")
 hardware_log_choose_button.setFixedWidth(32)
-hardware_log_choose_button.clicked.connect(lambda: choose_file(hardware_log_filename,"Choose where to save the log data"))
+hardware_log_choose_button.clicked.connect(lambda: choose_file(hardware_log_filename,"Choose where to save the log data","Binary log data (*.bin)"))
 hardware_log_box_layout.addWidget(hardware_log_choose_button)
+hardware_log_export_button = QtGui.QPushButton("Export")
+hardware_log_export_button.clicked.connect(export_log)
+hardware_log_box_layout.addWidget(hardware_log_export_button)
 
 hardware_log_box_layout.setSpacing(5)
 hardware_log_box_layout.setContentsMargins(3,9,3,3)
@@ -1462,19 +1592,25 @@ vbox.setContentsMargins(0,0,0,0)
 mainwidget.setLayout(vbox)
 
 def periodic_update(): # A state machine is used to determine which functions need to be called, depending on the current state of the program
-	if state == States.Idle_Init:
-		idle_init()
-	elif state == States.Idle:
-		read_potential_current()
-		update_live_graph()
-	elif state == States.Measuring_CV:
-		cv_update()
-	elif state == States.Measuring_CD:
-		cd_update()
-	elif state == States.Measuring_Rate:
-		rate_update()
-	elif state == States.Stationary_Graph:
-		read_potential_current()
+	while len(engine.messages) > 0: # Messages from background threads
+		log_message(engine.messages.popleft())
+	for i in range(stream_gui_max_samples if streaming_enabled else 1): # In streaming mode, process the samples queued since the last update
+		if state == States.Idle_Init:
+			idle_init()
+		elif state == States.Idle:
+			if read_potential_current():
+				update_live_graph()
+		elif state == States.Measuring_CV:
+			cv_update()
+		elif state == States.Measuring_CD:
+			cd_update()
+		elif state == States.Measuring_Rate:
+			rate_update()
+		elif state == States.Stationary_Graph:
+			read_potential_current()
+		if not streaming_enabled or len(dev.samples) == 0:
+			break
+	refresh_plots()
 
 timer = QtCore.QTimer()
 timer.timeout.connect(periodic_update)
@@ -1482,5 +1618,6 @@ timer.start(qt_timer_period) # Calls periodic_update() every adcread_interval (a
 
 log_message("Program started. Press the \"Connect\" button in the hardware tab to connect to the USB interface.")
 
+app.aboutToQuit.connect(lambda: toggle_logging(0)) # Write any buffered log records to disk
 win.show() # Show the main window
 sys.exit(app.exec_()) # Keep the program running by periodically calling the periodic_update() until the GUI window is closed
@@ -0,0 +1,179 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+# This program measures the performance of the host-device path of the USB potentiostat/galvanostat: round-trip latency of individual commands, the sustained
+# sample rate and timestamp jitter in polled and streaming mode, and the host CPU usage of each. The results are written as JSON, so that runs on different
+# hosts, operating systems or firmware images can be compared. The cell is kept switched off during the whole benchmark, so no cell needs to be connected.
+# It requires the same packages as tdstatv3_engine.py (Python 3.x, Numpy, and PyUSB).
+
+# Author: Thomas Dobbelaere
+# License: GPL
+
+import sys
+import argparse
+import json
+import platform
+import time
+import timeit
+import numpy
+import tdstatv3_engine as engine
+import tdstatv3_emulator
+
+latency_commands = [b'ADCREAD', b'OFFSETREAD', b'DACCALGET', b'SHUNTCALREAD', b'CALREAD', b'CALSTATUS', b'WAVESTATUS', b'CELL OFF'] # Commands whose round trip is timed; all of them leave the device state unchanged
+latency_batch_length = 4 # Number of commands in the timed batch transfer (the last one of them being ADCREAD)
+latency_histogram_bins = numpy.geomspace(1e-5, 1., 51) # Histogram bin edges (in s) for round-trip latencies, logarithmically spaced from 10 us to 1 s
+polled_interval = 0.09 # Default time (in s) between two ADCREAD commands in polled mode, as used by the GUI
+
+def distribution(values):
+	"""Summarize a list of durations (in s) as a dictionary of statistics in ms, together with a logarithmic histogram."""
+	values = numpy.asarray(values, dtype=float)
+	if len(values) == 0:
+		return {"count": 0}
+	counts, edges = numpy.histogram(values, latency_histogram_bins)
+	return {"count": len(values), "mean_ms": 1e3*values.mean(), "std_ms": 1e3*values.std(), "min_ms": 1e3*values.min(), "p50_ms": 1e3*numpy.percentile(values, 50), "p90_ms": 1e3*numpy.percentile(values, 90), "p99_ms": 1e3*numpy.percentile(values, 99), "max_ms": 1e3*values.max(),
+		"histogram": {"edges_ms": (1e3*edges).tolist(), "counts": counts.tolist(), "below": int((values < edges[0]).sum()), "above": int((values >= edges[-1]).sum())}}
+
+class CPUMeter:
+	"""Measure the wall-clock time and the CPU time used by this process (all threads, including the USB reader) between start() and stop()."""
+	def start(self):
+		self.wall_start = timeit.default_timer()
+		self.cpu_start = time.process_time()
+
+	def stop(self):
+		wall_time = timeit.default_timer()-self.wall_start
+		cpu_time = time.process_time()-self.cpu_start
+		return {"wall_time_s": wall_time, "cpu_time_s": cpu_time, "cpu_usage": cpu_time/wall_time if wall_time > 0 else 0.}
+
+def wait_until(deadline, busyloop):
+	"""Wait until the host timer reaches the deadline, either by sleeping (as the GUI does on Linux/OSX) or by a busy loop (as the GUI does on MS Windows)."""
+	if busyloop:
+		while timeit.default_timer() < deadline:
+			pass
+	else:
+		remaining = deadline-timeit.default_timer()
+		if remaining > 0:
+			time.sleep(remaining)
+
+def benchmark_latency(device, repeats):
+	"""Time the round trip of each command in latency_commands, and of a batch transfer, repeats times each; the device must be in polled mode."""
+	results = {}
+	meter = CPUMeter()
+	for command_string in latency_commands:
+		latencies = []
+		replies = {}
+		meter.start()
+		for i in range(repeats):
+			start = timeit.default_timer()
+			response = device.command(command_string, None)
+			latencies.append(timeit.default_timer()-start)
+			key = response.decode() if response in (b'WAIT', b'BUSY', b'?') else "data"
+			replies[key] = replies.get(key, 0)+1
+		results[command_string.decode()] = dict(distribution(latencies), replies=replies, **meter.stop())
+	if device.binary_protocol: # Without it, send_batch() falls back to one transfer per command
+		batch = [b'CELL OFF']*(latency_batch_length-1)+[b'ADCREAD']
+		latencies = []
+		meter.start()
+		for i in range(repeats):
+			start = timeit.default_timer()
+			device.send_batch(batch)
+			latencies.append(timeit.default_timer()-start)
+		results["batch of %d"%latency_batch_length] = dict(distribution(latencies), **meter.stop())
+	return results
+
+def benchmark_polled(device, duration, interval, busyloop):
+	"""Poll the ADC with ADCREAD every interval seconds during duration seconds, like the GUI does without streaming; return the sample rate, the jitter of the sample times, and the host CPU usage."""
+	sample_times = []
+	wait_replies = 0
+	requests = 0
+	meter = CPUMeter()
+	meter.start()
+	starttime = timeit.default_timer()
+	next_request = starttime
+	while timeit.default_timer()-starttime < duration:
+		wait_until(next_request, busyloop)
+		request_time = timeit.default_timer()
+		next_request = request_time+interval
+		requests += 1
+		if device.command(b'ADCREAD', None) in (b'WAIT', b'BUSY'): # The conversion has not yet finished
+			wait_replies += 1
+		else:
+			sample_times.append(request_time)
+	result = meter.stop()
+	intervals = numpy.diff(sample_times)
+	result.update({"timing": "busyloop" if busyloop else "sleep", "interval_ms": 1e3*interval, "requests": requests, "wait_replies": wait_replies, "samples": len(sample_times), "sample_rate_hz": len(sample_times)/result["wall_time_s"], "sample_interval": distribution(intervals)})
+	return result
+
+def benchmark_streaming(device, duration, period):
+	"""Let the device stream its conversions, started every period ms, during duration seconds; return the sample rate, the jitter of the sample times and of their arrival, and the host CPU usage. Returns None if the firmware cannot stream."""
+	device.acquisition_period = period
+	if not device.stream_start():
+		return None
+	device.set_stream_latency(0) # Every sample is sent as soon as it is available, which gives the highest frame rate
+	device.set_stream_decimation(1)
+	sample_times = []
+	arrival_times = []
+	meter = CPUMeter()
+	meter.start()
+	starttime = timeit.default_timer()
+	while timeit.default_timer()-starttime < duration:
+		if len(device.samples) == 0:
+			time.sleep(0.001)
+			continue
+		arrival_time = timeit.default_timer()
+		while len(device.samples) > 0:
+			sample_times.append(device.samples.popleft().time) # Sample times are derived from the device clock
+			arrival_times.append(arrival_time)
+	result = meter.stop()
+	device.stream_stop()
+	intervals = numpy.diff(sample_times)
+	result.update({"period_ms": period, "samples": len(sample_times), "sample_rate_hz": len(sample_times)/result["wall_time_s"], "sample_interval": distribution(intervals), "delivery_delay": distribution(numpy.asarray(arrival_times)-numpy.asarray(sample_times))})
+	return result
+
+def host_info():
+	return {"system": platform.system(), "release": platform.release(), "machine": platform.machine(), "python": platform.python_version(), "numpy": numpy.__version__, "timer_resolution_s": time.get_clock_info("perf_counter").resolution}
+
+def run_benchmark(device, args):
+	"""Run all benchmark phases on an opened device and return the results as a dictionary."""
+	device.set_cell(False)
+	device.stream_stop() # Latency and polled phases need polled mode
+	if device.read_stats(reset=True) is not None: # With firmware built with "make STATS=1", the counters then only cover the benchmark
+		device.select_stats_command(b'ADCREAD') # The command timed most often by the benchmark
+	results = {"host": host_info(), "device": {"serial_number": device.serial_number, "manufacturer": device.manufacturer, "product": device.product, "binary_protocol": device.binary_protocol},
+		"settings": {"repeats": args.repeats, "duration_s": args.duration, "emulated": args.emulate}}
+	results["latency"] = benchmark_latency(device, args.repeats)
+	results["polled"] = [benchmark_polled(device, args.duration, args.interval, busyloop) for busyloop in ([False, True] if args.timing == "both" else [args.timing == "busyloop"])]
+	results["streaming"] = benchmark_streaming(device, args.duration, args.period)
+	results["firmware_stats"] = device.read_stats()
+	return results
+
+parser = argparse.ArgumentParser(description="Measure command latency, sample rate, timestamp jitter and host CPU usage of a USB potentiostat/galvanostat; the results are written as JSON.")
+parser.add_argument("--vid", default="0x%04x"%engine.usb_vid, help="USB vendor ID")
+parser.add_argument("--pid", default="0x%04x"%engine.usb_pid, help="USB product ID")
+parser.add_argument("--serial", help="serial number of the device to use (default: the first device found)")
+parser.add_argument("--repeats", type=int, default=200, help="number of round trips timed per command")
+parser.add_argument("--duration", type=float, default=10., help="duration (in s) of each sampling phase")
+parser.add_argument("--interval", type=float, default=1e3*polled_interval, help="time (in ms) between two ADCREAD commands in polled mode")
+parser.add_argument("--timing", choices=["sleep", "busyloop", "both"], default="both", help="how the polled phase waits between two ADCREAD commands: sleeping (as the GUI on Linux/OSX), a busy loop (as the GUI on MS Windows), or one phase with each")
+parser.add_argument("--period", type=int, default=engine.acquisition_period, help="time (in ms) between two conversions in streaming mode")
+parser.add_argument("--emulate", action="store_true", help="benchmark an emulated device (see tdstatv3_emulator.py) instead of a USB device, which measures the host software alone")
+parser.add_argument("--conversion-time", type=float, default=1e3*tdstatv3_emulator.conversion_time, help="ADC conversion time (in ms) of the emulated device; together with a short --period, this gives sample rates far above those of the real device")
+parser.add_argument("-o", "--output", help="output file for the JSON results (default: standard output)")
+
+if __name__ == "__main__":
+	args = parser.parse_args()
+	args.interval = 1e-3*args.interval # Convert ms to s
+	if args.emulate:
+		device = tdstatv3_emulator.open_device(args.serial, conversion_time=1e-3*args.conversion_time, stats=True) # With the counters of a "make STATS=1" build
+	else:
+		device = engine.open_device(args.serial, int(args.vid, 0), int(args.pid, 0), engine.CalibrationCache())
+	try:
+		results = run_benchmark(device, args)
+	finally:
+		device.close()
+	while len(engine.messages) > 0:
+		print(engine.messages.popleft(), file=sys.stderr)
+	if args.output is None:
+		print(json.dumps(results, indent=2))
+	else:
+		with open(args.output, "w") as f:
+			json.dump(results, f, indent=2)
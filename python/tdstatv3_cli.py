@@ -0,0 +1,167 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+# This program runs measurements on one or more USB potentiostats/galvanostats from the command line, without a graphical user interface.
+# Each device is identified by its serial number and runs its measurement in a separate thread; all output files share the same time axis.
+# It requires the same packages as tdstatv3_engine.py (Python 3.x, Numpy, and PyUSB).
+
+# Author: Thomas Dobbelaere
+# License: GPL
+
+import sys
+import os.path
+import argparse
+import json
+import threading
+import timeit
+import time
+import numpy
+import tdstatv3_engine as engine
+import tdstatv3_emulator
+
+def output_filename(filename, serial, number_of_devices):
+	"""Return the output file name for a given device; with more than one device, the serial number is appended to the base name."""
+	if number_of_devices == 1:
+		return filename
+	base, extension = os.path.splitext(filename)
+	return "%s_%s%s"%(base, serial, extension)
+
+def open_device(args, serial):
+	"""Open a device by serial number (None for the first device found), or create an emulated one with the --emulate option."""
+	if args.emulate:
+		return tdstatv3_emulator.open_device(serial, conversion_time=args.conversion_time, stats=True) # With the counters of a "make STATS=1" build
+	return engine.open_device(serial, int(args.vid, 0), int(args.pid, 0), engine.CalibrationCache())
+
+def list_devices(args):
+	devices = engine.find_devices(int(args.vid, 0), int(args.pid, 0))
+	for serial, usb_device in devices:
+		print(serial)
+	if len(devices) == 0:
+		print("No USB devices found.", file=sys.stderr)
+
+def run_technique(args, technique):
+	"""Open the requested devices and run technique(device, writer, stop_event, starttime) on each of them in a separate thread, until all have finished or Ctrl-C is pressed."""
+	serials = args.serial if args.serial else [None]
+	devices = [open_device(args, serial) for serial in serials]
+	writers = [engine.OutputWriter(output_filename(args.output, device.serial_number, len(devices)), "Elapsed time(s)\tPotential(V)\tCurrent(A)") for device in devices]
+	stop_event = threading.Event()
+	results = [None]*len(devices)
+	starttime = timeit.default_timer() # Common time origin for all devices
+	def worker(i):
+		try:
+			results[i] = technique(devices[i], writers[i], stop_event, starttime)
+		except (engine.DeviceError, IOError) as error:
+			engine.messages.append("%s: %s"%(devices[i].serial_number, error))
+	threads = [threading.Thread(target=worker, args=(i,)) for i in range(len(devices))]
+	for thread in threads:
+		thread.start()
+	try:
+		while any(thread.is_alive() for thread in threads):
+			while len(engine.messages) > 0:
+				print(engine.messages.popleft(), file=sys.stderr)
+			time.sleep(0.1)
+	except KeyboardInterrupt:
+		stop_event.set() # Let every technique finish cleanly, which switches the cells off
+		for thread in threads:
+			thread.join()
+	while len(engine.messages) > 0:
+		print(engine.messages.popleft(), file=sys.stderr)
+	for writer in writers:
+		writer.close()
+	for device in devices:
+		device.close()
+	return [(device.serial_number, result) for device, result in zip(devices, results)]
+
+def record(args):
+	run_technique(args, lambda device, writer, stop_event, starttime: engine.record(device, args.duration, writer, args.numsamples, stop_event, starttime))
+
+def cyclic_voltammetry(args):
+	enabled_ranges = [engine.current_range_list.index(name) for name in args.ranges] if args.ranges else [0,1,2]
+	results = run_technique(args, lambda device, writer, stop_event, starttime: engine.cyclic_voltammetry(device, args.lbound, args.ubound, args.startpot, args.stoppot, args.scanrate, args.numcycles, writer, args.numsamples, enabled_ranges, stop_event))
+	for serial, charge in results:
+		if charge is not None:
+			print("%s: charge between zero crossings (uAh): %s"%(serial, ", ".join("%.3f"%value for value in charge)))
+
+def charge_discharge(args):
+	results = run_technique(args, lambda device, writer, stop_event, starttime: engine.charge_discharge(device, args.chargecurrent, args.dischargecurrent, args.ubound, args.lbound, args.numhalfcycles, writer, args.numsamples, stop_event))
+	for serial, charges in results:
+		if charges is not None:
+			print("%s: half cycle capacities (Ah): %s"%(serial, ", ".join("%e"%value for value in charges)))
+
+def play_waveform(args):
+	potentials = numpy.loadtxt(args.input, ndmin=1)
+	results = run_technique(args, lambda device, writer, stop_event, starttime: engine.play_waveform(device, potentials, args.period, writer, args.numsamples, stop_event))
+	for serial, underruns in results:
+		if underruns is not None:
+			print("%s: %d underruns"%(serial, underruns))
+
+def print_stats(args):
+	device = open_device(args, args.serial)
+	stats = device.read_stats(args.reset)
+	if stats is not None and args.command is not None:
+		device.select_stats_command(args.command.encode())
+	device.close()
+	if stats is None:
+		print("The firmware does not keep performance counters; rebuild it with \"make STATS=1\".", file=sys.stderr)
+		sys.exit(1)
+	print(json.dumps(stats, indent=2))
+
+parser = argparse.ArgumentParser(description="Run measurements on USB potentiostats/galvanostats without a graphical user interface.")
+parser.add_argument("--vid", default="0x%04x"%engine.usb_vid, help="USB vendor ID")
+parser.add_argument("--pid", default="0x%04x"%engine.usb_pid, help="USB product ID")
+parser.add_argument("--emulate", action="store_true", help="use emulated devices (see tdstatv3_emulator.py) instead of USB devices")
+parser.add_argument("--conversion-time", type=float, default=1e3*tdstatv3_emulator.conversion_time, help="ADC conversion time (in ms) of emulated devices")
+subparsers = parser.add_subparsers(dest="subcommand")
+subparsers.required = True
+
+list_parser = subparsers.add_parser("list", help="print the serial numbers of all connected devices")
+list_parser.set_defaults(function=list_devices)
+
+stats_parser = subparsers.add_parser("stats", help="print the firmware performance counters as JSON")
+stats_parser.add_argument("--serial", help="serial number of the device to use (default: the first device found)")
+stats_parser.add_argument("--reset", action="store_true", help="clear the counters after reading them")
+stats_parser.add_argument("--command", choices=[name.decode().strip() for name, payload_length in engine.command_opcodes], help="time this command from now on, in the \"command\" counter")
+stats_parser.set_defaults(function=print_stats)
+
+def add_common_arguments(subparser):
+	subparser.add_argument("--serial", action="append", help="serial number of a device to use; repeat to use several devices at once (default: the first device found)")
+	subparser.add_argument("--numsamples", type=int, default=1, help="number of samples to average")
+	subparser.add_argument("-o", "--output", required=True, help="output file; with several devices, the serial number is appended to the base name")
+
+record_parser = subparsers.add_parser("record", help="record potential and current")
+add_common_arguments(record_parser)
+record_parser.add_argument("--duration", type=float, default=None, help="duration (in s) of the recording (default: until Ctrl-C is pressed)")
+record_parser.set_defaults(function=record)
+
+cv_parser = subparsers.add_parser("cv", help="run a cyclic voltammetry scan")
+add_common_arguments(cv_parser)
+cv_parser.add_argument("--lbound", type=float, required=True, help="lower bound (in V)")
+cv_parser.add_argument("--ubound", type=float, required=True, help="upper bound (in V)")
+cv_parser.add_argument("--startpot", type=float, required=True, help="start potential (in V)")
+cv_parser.add_argument("--stoppot", type=float, required=True, help="stop potential (in V)")
+cv_parser.add_argument("--scanrate", type=float, required=True, help="scan rate (in mV/s); a negative scan rate starts towards the lower bound")
+cv_parser.add_argument("--numcycles", type=int, default=1, help="number of cycles")
+cv_parser.add_argument("--ranges", nargs="+", choices=engine.current_range_list, help="current ranges to autorange over (default: all)")
+cv_parser.set_defaults(function=cyclic_voltammetry)
+
+cd_parser = subparsers.add_parser("cd", help="run galvanostatic charge/discharge cycles")
+add_common_arguments(cd_parser)
+cd_parser.add_argument("--lbound", type=float, required=True, help="lower potential limit (in V)")
+cd_parser.add_argument("--ubound", type=float, required=True, help="upper potential limit (in V)")
+cd_parser.add_argument("--chargecurrent", type=float, required=True, help="charge current (in mA)")
+cd_parser.add_argument("--dischargecurrent", type=float, required=True, help="discharge current (in mA); must have the opposite sign of the charge current")
+cd_parser.add_argument("--numhalfcycles", type=int, default=2, help="number of half cycles")
+cd_parser.set_defaults(function=charge_discharge)
+
+wave_parser = subparsers.add_parser("wave", help="apply an arbitrary sequence of potentials")
+add_common_arguments(wave_parser)
+wave_parser.add_argument("--input", required=True, help="text file with one potential (in V) per line")
+wave_parser.add_argument("--period", type=int, required=True, help="time (in ms) between two potentials")
+wave_parser.set_defaults(function=play_waveform)
+
+if __name__ == "__main__":
+	args = parser.parse_args()
+	if hasattr(args, "scanrate"):
+		args.scanrate = 1e-3*args.scanrate # Convert mV/s to V/s
+	args.conversion_time = 1e-3*args.conversion_time # Convert ms to s
+	args.function(args)
@@ -0,0 +1,804 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+# This Python module emulates the USB potentiostat/galvanostat in software, so that the host software can be tested, benchmarked and profiled without hardware.
+# EmulatedDevice stands in for the PyUSB device object (write() to EP1 OUT, read() from EP1 IN, and the string descriptors) and runs a port of the firmware's
+# main loop in a background thread: the same command table and batch protocol, streaming with its ring buffer and data frames, the CV sweep engine, waveform
+# playback, the charge/discharge controller, autoranging, decimation, and the calibration blocks. The MCP3550 is modelled with its conversion time, so ADCREAD
+# replies "WAIT" just like the real device, and the cell is a dummy cell (a resistor in series with a capacitor) with Gaussian ADC noise. Unless another serial number is
+# given, an emulated device reports the default serial number of an unprogrammed board, so its calibration is never cached.
+# It requires the same packages as tdstatv3_engine.py (Python 3.x, Numpy, and PyUSB).
+
+# Author: Thomas Dobbelaere
+# License: GPL
+
+import timeit
+import errno
+import math
+import random
+import collections
+import threading
+import usb.core
+import tdstatv3_engine as engine
+
+manufacturer = "CoCooN research group" # String descriptors reported by the firmware
+product = "USB Potentiostat/galvanostat"
+ep1_length = 64 # Size of the EP1 packets (EP_1_IN_LEN and EP_1_OUT_LEN in usb_config.h)
+conversion_time = 0.08 # Default MCP3550-50 conversion time (in s)
+main_loop_interval = 0.0005 # Time (in s) the emulated main loop waits for a command before running its services again
+relay_make_time = 10 # The firmware constants of the same name (see main.c)
+dac_selfcal_time = 500
+max_delay = 1000
+stream_frame_marker = 0xA5
+stream_header_length = 10
+stream_sample_length = 6
+stream_max_samples = (ep1_length-stream_header_length)//stream_sample_length
+stream_ring_size = 20
+stream_ring_size_pingpong = 11
+stream_default_latency = 100
+stream_flag_galvanostatic = 0x04
+stream_flag_cell_on = 0x08
+stream_flag_sweep = 0x10
+stream_flag_cd = 0x20
+stream_flag_cd_phase = 0x40
+stream_flag_invalid = 0x80
+wave_chunk_codes = 20
+wave_fifo_size = 40
+command_opcode_base = 0x80
+command_batch = 0xFF
+calibration_length = 6
+max_reply_length = 3*calibration_length
+serial_number_length = 8
+perf_counters = 5 # The firmware's performance counters (see PERF_* in main.c), of which the emulator times interpret_command() and the selected command in host time
+perf_interpret = 3
+perf_command = 4
+perf_stats_events = 0xFE
+perf_stats_reset = 0xFF
+dac_selfcal_result = bytes([0x80,0x00,0x00,0x80,0x00,0x00]) # Offset and gain registers of the DAC1220 after a self-calibration (zero offset, nominal gain)
+compliance_voltage = 8. # Maximum potential (in V) the emulated potentiostat can apply, equal to the full scale of the potential ADC channel
+full_scale_current = 25e-3 # Current (in A) at the full scale of the current ADC channel in the 20 mA range; each further range is 100 times more sensitive
+
+def dac_bytes_to_code(dac_data):
+	return (dac_data[0] << 12) | (dac_data[1] << 4) | (dac_data[2] >> 4) # See DAC1220 datasheet (20-bit mode)
+
+def mcp3550_to_int(adc_data):
+	value = ((adc_data[0] & 0x3F) << 16) | (adc_data[1] << 8) | adc_data[2]
+	if (adc_data[0] & 0x80) or (adc_data[0] & 0x60) == 0x20: # Overflow low, or negative without overflow
+		value -= 0x400000
+	return value
+
+def int_to_mcp3550(value):
+	"""Convert a raw ADC value to the three bytes sent by the MCP3550, including its overflow bits; values beyond the overflow range saturate."""
+	value = max(-0x400000, min(0x3FFFFF, value))
+	if value >= 0x200000: # Overflow high
+		code = 0x400000 | (value & 0x3FFFFF)
+	elif value < -0x200000: # Overflow low
+		code = 0x800000 | (value+0x400000)
+	else:
+		code = value & 0x3FFFFF
+	return bytes([code >> 16 & 0xFF, code >> 8 & 0xFF, code & 0xFF])
+
+def int24(data):
+	value = (data[0] << 16) | (data[1] << 8) | data[2]
+	return value-0x1000000 if data[0] & 0x80 else value
+
+def uint16(data):
+	return (data[0] << 8) | data[1]
+
+class MCP3550:
+	"""Model of the potential and current ADCs, which share a chip select: a conversion starts when they are selected while idle, and its result can be read once the conversion time has passed."""
+	def __init__(self, conversion_time, measure):
+		self.conversion_time = conversion_time
+		self.measure = measure # Function returning the two raw ADC values at a given time
+		self.conversion_started = None # Host time at which the running conversion was started, or None if the ADCs are idle
+
+	def start(self, now):
+		if self.conversion_started is None:
+			self.conversion_started = now
+
+	def read_result(self, now):
+		"""Return the six result bytes if a conversion has finished, or None; as with the real ADCs, polling them while idle starts a conversion."""
+		if self.conversion_started is None:
+			self.conversion_started = now
+			return None
+		if now-self.conversion_started < self.conversion_time:
+			return None
+		self.conversion_started = None
+		raw_potential, raw_current = self.measure(now)
+		return int_to_mcp3550(raw_potential)+int_to_mcp3550(raw_current)
+
+	def read(self, now):
+		"""Read a finished conversion and immediately start the next one, as for ADCREAD."""
+		data = self.read_result(now)
+		if data is not None:
+			self.start(now)
+		return data
+
+class EmulatedDevice:
+	"""Software model of a potentiostat, offering the part of the PyUSB device interface used by tdstatv3_engine.Device.
+	The dummy cell has a given resistance (in ohm) and capacitance (in F), and the ADC readings get Gaussian noise with a given standard deviation (in ADC counts).
+	With a shorter conversion_time (in s) and a short STREAM PERIOD, the emulated device delivers samples far faster than real hardware. With stats, it has the STATS command of firmware built with "make STATS=1"."""
+	def __init__(self, serial_number=engine.default_serial_number, conversion_time=conversion_time, resistance=1e3, capacitance=1e-3, noise=2., pingpong=False, calibration=None, stats=False):
+		self.manufacturer = manufacturer
+		self.product = product
+		self.serial_number = serial_number
+		self.resistance = resistance
+		self.capacitance = capacitance
+		self.noise = noise
+		self.in_buffers = 2 if pingpong else 1 # Number of EP1 IN buffers; the firmware uses two when built with PINGPONG=1
+		self.stream_ring_size = stream_ring_size_pingpong if pingpong else stream_ring_size
+		self.calibration_blocks = [bytes(calibration[i]) if calibration is not None else bytes([255]*calibration_length) for i in range(3)] # Offset, DAC and shunt calibration as stored in flash memory
+		self.dac_registers = dac_selfcal_result
+		self.adc = MCP3550(conversion_time, self.measure)
+		self.lock = threading.Condition() # Guards all state below; notified whenever a packet is written or read
+		self.out_packet = None # Packet received on EP1 OUT and not yet processed by the main loop
+		self.in_packets = collections.deque() # Packets waiting in the EP1 IN buffers to be read by the host
+		self.boot_time = timeit.default_timer()
+		self.cell_on = False
+		self.galvanostatic = False
+		self.dac_code = 2**19 # Zero output
+		self.capacitor_voltage = 0.
+		self.cell_time = self.boot_time
+		self.current_range = 0
+		self.relay_switching = False
+		self.relay_switch_tick = 0
+		self.conversion_invalid = False # The running conversion overlaps a relay transition
+		self.sweep_running = False
+		self.wave_running = False
+		self.wave_fifo = collections.deque()
+		self.wave_codes_left = 0
+		self.wave_underruns = 0
+		self.cd_running = False
+		self.dac_cal_running = False
+		self.dac_cal_started = 0
+		self.streaming_enabled = False
+		self.stream_ring = collections.deque() # Samples waiting to be shipped, as (tick, flags, decimation, data) tuples
+		self.stream_frame_counter = 0
+		self.stream_overflows = 0
+		self.stream_latency = stream_default_latency
+		self.acquisition_period = 90
+		self.next_acquisition = 0
+		self.conversion_running = False
+		self.conversion_discard = False
+		self.conversion_started = 0
+		self.decimation = 1
+		self.decimation_count = 0
+		self.autorange_mask = 0
+		self.delay_pending = False # A DELAY is running; the command packet stays in EP1 OUT and the reply is held back until it ends
+		self.delay_end = 0
+		self.batch_position = None # Position in received_data of the next command of the batch suspended by the pending DELAY, or None
+		self.reply = b''
+		self.perf_counters = [[0, 0, 0, 0] for i in range(perf_counters)] # Number of measurements, minimum, maximum and sum, in counts of the firmware's Timer1
+		self.perf_command = None # Index in the command table of the command timed in perf_counters[perf_command]
+		self.perf_events = [0, 0, 0] # WAIT replies, EP1 busy passes, dropped samples
+		handlers = {b'CELL ON': self.command_cell_on, b'CELL OFF': self.command_cell_off, b'POTENTIOSTATIC': self.command_mode_potentiostatic, b'GALVANOSTATIC': self.command_mode_galvanostatic,
+			b'RANGE 1': self.command_range1, b'RANGE 2': self.command_range2, b'RANGE 3': self.command_range3, b'DACSET ': self.command_set_dac, b'DACCAL': self.command_calibrate_dac,
+			b'ADCREAD': self.command_read_adc, b'OFFSETREAD': self.command_read_offset, b'OFFSETSAVE ': self.command_save_offset, b'DACCALGET': self.command_read_dac_cal,
+			b'DACCALSET ': self.command_set_dac_cal, b'SHUNTCALREAD': self.command_read_shuntcalibration, b'SHUNTCALSAVE ': self.command_save_shuntcalibration, b'STREAM START': self.command_stream_start,
+			b'STREAM STOP': self.command_stream_stop, b'STREAM LATENCY ': self.command_stream_latency, b'STREAM PERIOD ': self.command_stream_period, b'CVSWEEP ': self.command_cv_sweep,
+			b'CVSTOP': self.command_cv_stop, b'CDSTART ': self.command_cd_start, b'CDSTOP': self.command_cd_stop, b'DELAY ': self.command_delay, b'AUTORANGE ': self.command_autorange,
+			b'DECIMATION ': self.command_decimation, b'SERIALSET ': self.command_set_serial, b'WAVEDATA ': self.command_wave_data, b'WAVESTART ': self.command_wave_start, b'WAVESTOP': self.command_wave_stop,
+			b'WAVESTATUS': self.command_wave_status, b'CALREAD': self.command_read_calibration, b'CALSTATUS': self.command_cal_status, b'STATS ': self.command_stats} # Handlers of the commands in engine.command_opcodes, which gives the order of the firmware's command table
+		self.commands = [(handlers[name], payload_length, name) for name, payload_length in (engine.command_opcodes if stats else engine.command_opcodes[:-1])] # STATS is last, as it is only in firmware built with "make STATS=1"; binary opcode 0x80 plus the index
+		self.stats = stats
+		self.running = True
+		self.thread = threading.Thread(target=self.main_loop)
+		self.thread.daemon = True
+		self.thread.start()
+
+	# USB transport, as used by tdstatv3_engine.Device
+
+	def write(self, endpoint, data, timeout=1000):
+		"""Send data to EP1 OUT, one packet at a time; like a real endpoint, a packet is only accepted once the previous one has been taken by the main loop."""
+		data = bytes(data)
+		for start in range(0, max(1, len(data)), ep1_length):
+			with self.lock:
+				if not self.lock.wait_for(lambda: self.out_packet is None, timeout/1e3):
+					raise usb.core.USBError("Operation timed out", errno=errno.ETIMEDOUT)
+				self.out_packet = data[start:start+ep1_length]
+				self.lock.notify_all()
+		return len(data)
+
+	def read(self, endpoint, size, timeout=1000):
+		"""Return the next packet from EP1 IN, waiting up to timeout ms for one."""
+		with self.lock:
+			if not self.lock.wait_for(lambda: len(self.in_packets) > 0, timeout/1e3):
+				raise usb.core.USBError("Operation timed out", errno=errno.ETIMEDOUT)
+			packet = self.in_packets.popleft()
+			self.lock.notify_all()
+		return packet[:size]
+
+	def dispose(self):
+		"""End the host session, as when the device is deconfigured; the emulated device keeps running and can be opened again."""
+		with self.lock:
+			self.streaming_enabled = False # A new host session always starts in polled mode
+			self.delay_pending = False # The held-back reply is dropped with the endpoint buffers
+			self.batch_position = None
+			self.in_packets.clear()
+			self.out_packet = None
+
+	def shutdown(self):
+		"""Stop the emulated main loop."""
+		self.running = False
+		self.thread.join()
+
+	def in_endpoint_busy(self):
+		return len(self.in_packets) >= self.in_buffers
+
+	# Main loop and services
+
+	def ticks(self):
+		return int((timeit.default_timer()-self.boot_time)*1e3) # Milliseconds since power-up
+
+	def main_loop(self):
+		with self.lock:
+			while self.running:
+				self.relay_service()
+				self.sweep_service()
+				self.wave_service()
+				self.dac_cal_service()
+				if self.streaming_enabled or self.cd_running:
+					self.stream_service()
+				if self.delay_pending:
+					if self.ticks() >= self.delay_end:
+						self.delay_pending = False
+						if self.batch_position is not None:
+							self.reply = self.interpret_batch() # The rest of the batch, which may hold another DELAY
+						self.send_reply()
+				elif self.out_packet is not None and not self.in_endpoint_busy(): # Otherwise, leave the command pending until an EP1 IN buffer is free
+					self.received_data = self.out_packet
+					start = timeit.default_timer()
+					self.reply = self.interpret_command()
+					if self.stats:
+						self.perf_record(perf_interpret, timeit.default_timer()-start)
+					self.send_reply()
+				elif self.out_packet is not None and self.stats:
+					self.perf_events[1] = (self.perf_events[1]+1)%2**16
+				self.lock.wait(main_loop_interval)
+
+	def send_reply(self):
+		"""Send the reply to the command in received_data and accept the next packet, unless a DELAY holds them back."""
+		if self.delay_pending:
+			return
+		self.out_packet = None
+		self.in_packets.append(self.reply)
+		self.lock.notify_all()
+
+	def interpret_command(self):
+		"""Execute the command in received_data and return the reply."""
+		data = self.received_data
+		if len(data) > 0 and data[0] == command_batch:
+			self.batch_position = 1
+			self.reply = b''
+			return self.interpret_batch()
+		if len(data) > 0 and data[0] >= command_opcode_base: # Binary command
+			i = data[0]-command_opcode_base
+			if i < len(self.commands) and len(data) == 1+self.commands[i][1]:
+				return self.run_command(i, data[1:])
+		else: # ASCII command
+			for i, (handler, payload_length, name) in enumerate(self.commands):
+				if len(data) == len(name)+payload_length and data.startswith(name):
+					return self.run_command(i, data[len(name):])
+		return b'?'
+
+	def run_command(self, i, args):
+		"""Execute the handler of the command with index i, timing it if it was selected with STATS."""
+		if i != self.perf_command:
+			return self.commands[i][0](args)
+		start = timeit.default_timer()
+		response = self.commands[i][0](args)
+		self.perf_record(perf_command, timeit.default_timer()-start)
+		return response
+
+	def interpret_batch(self):
+		"""Execute the binary commands of a batch packet from batch_position on, and return their replies so far, each prefixed with its length. A DELAY suspends the batch (see main_loop())."""
+		data = self.received_data
+		position = self.batch_position
+		reply = self.reply
+		while position < len(data) and len(reply)+1+max_reply_length <= ep1_length:
+			i = data[position]-command_opcode_base
+			if i < 0 or i >= len(self.commands) or position+1+self.commands[i][1] > len(data):
+				break # Malformed command; the host notices from the number of replies
+			payload_length = self.commands[i][1]
+			response = self.run_command(i, data[position+1:position+1+payload_length])
+			reply += bytes([len(response)])+response
+			position += 1+payload_length
+			if self.delay_pending:
+				break
+		self.batch_position = position if self.delay_pending else None
+		return reply
+
+	# Dummy cell and ADC model
+
+	def cell_drive(self):
+		"""Return the potential (in V) and current (in A) applied to the dummy cell in the present state, and whether the potential rather than the current is imposed."""
+		if not self.cell_on:
+			return self.capacitor_voltage, 0., False
+		setpoint = (self.dac_code-2**19)/2.**19 # DAC output relative to its full scale
+		range_full_scale = full_scale_current/100.**self.current_range
+		if self.galvanostatic:
+			current = setpoint*range_full_scale
+			potential = self.capacitor_voltage+current*self.resistance
+			if abs(potential) <= compliance_voltage:
+				return potential, current, False
+			potential = math.copysign(compliance_voltage, potential) # Out of compliance
+		else:
+			potential = setpoint*compliance_voltage
+		current = (potential-self.capacitor_voltage)/self.resistance
+		if abs(current) > range_full_scale: # The output stage cannot drive more than the full scale of the range
+			current = math.copysign(range_full_scale, current)
+			return self.capacitor_voltage+current*self.resistance, current, False
+		return potential, current, True
+
+	def cell_advance(self, now):
+		"""Charge the capacitor of the dummy cell up to the given time; must be called before any change of the cell connection, mode, range or DAC output."""
+		dt = now-self.cell_time
+		self.cell_time = now
+		if dt <= 0 or not self.cell_on:
+			return
+		potential, current, potential_imposed = self.cell_drive()
+		if potential_imposed: # Exponential approach of the imposed potential
+			self.capacitor_voltage = potential+(self.capacitor_voltage-potential)*math.exp(-dt/(self.resistance*self.capacitance))
+		else:
+			self.capacitor_voltage += current*dt/self.capacitance
+			self.capacitor_voltage = max(-compliance_voltage, min(compliance_voltage, self.capacitor_voltage))
+
+	def measure(self, now):
+		"""Return the raw potential and current ADC values at the given time."""
+		self.cell_advance(now)
+		potential, current, potential_imposed = self.cell_drive()
+		raw_potential = potential/compliance_voltage*2**21
+		raw_current = current/(full_scale_current/100.**self.current_range)*2**21
+		return int(round(raw_potential+random.gauss(0., self.noise))), int(round(raw_current+random.gauss(0., self.noise)))
+
+	def write_dac(self, dac_data):
+		self.cell_advance(timeit.default_timer())
+		self.dac_code = dac_bytes_to_code(dac_data)
+
+	def write_dac_code(self, code):
+		self.cell_advance(timeit.default_timer())
+		self.dac_code = code
+
+	# Command handlers, as in main.c
+
+	def command_cell_on(self, args):
+		self.cell_advance(timeit.default_timer())
+		self.cell_on = True
+		return b'OK'
+
+	def command_cell_off(self, args):
+		self.cell_advance(timeit.default_timer())
+		self.cell_on = False
+		return b'OK'
+
+	def command_mode_potentiostatic(self, args):
+		self.cell_advance(timeit.default_timer())
+		self.galvanostatic = False
+		return b'OK'
+
+	def command_mode_galvanostatic(self, args):
+		self.cell_advance(timeit.default_timer())
+		self.galvanostatic = True
+		return b'OK'
+
+	def set_current_range(self, index):
+		if index == self.current_range or index > 2:
+			return
+		self.cell_advance(timeit.default_timer())
+		self.current_range = index
+		self.relay_switching = True # The new relay is made now, and the old one broken in relay_service()
+		self.relay_switch_tick = self.ticks()
+		self.conversion_invalid = True
+
+	def relay_service(self):
+		if self.relay_switching and self.ticks()-self.relay_switch_tick >= relay_make_time:
+			self.relay_switching = False
+			self.conversion_invalid = True # A conversion started before this moment is flagged invalid
+
+	def command_range1(self, args):
+		self.set_current_range(0)
+		return b'OK'
+
+	def command_range2(self, args):
+		self.set_current_range(1)
+		return b'OK'
+
+	def command_range3(self, args):
+		self.set_current_range(2)
+		return b'OK'
+
+	def dac_cal_busy(self):
+		"""Nothing may write to the DAC1220 during its self-calibration; commands that would reply "BUSY" instead."""
+		return self.dac_cal_running
+
+	def command_set_dac(self, dac_data):
+		if self.dac_cal_busy():
+			return b'BUSY'
+		self.write_dac(dac_data)
+		return b'OK'
+
+	def command_cv_sweep(self, sweep_data):
+		if self.dac_cal_busy():
+			return b'BUSY'
+		self.sweep_position = dac_bytes_to_code(sweep_data)
+		self.sweep_vertex = [dac_bytes_to_code(sweep_data[3:6]), dac_bytes_to_code(sweep_data[6:9])]
+		self.sweep_stop = dac_bytes_to_code(sweep_data[9:12])
+		self.sweep_step = max(1, dac_bytes_to_code(sweep_data[12:15]))
+		self.sweep_period = uint16(sweep_data[15:17])
+		self.sweep_legs_left = 2*uint16(sweep_data[17:19])+1 # Each cycle goes to the second vertex and back, followed by a leg to the stop potential
+		self.sweep_target = self.sweep_vertex[0]
+		self.write_dac_code(self.sweep_position)
+		self.next_sweep_step = self.ticks()+self.sweep_period
+		self.wave_running = False # The sweep and the waveform playback both drive the DAC
+		self.sweep_running = True
+		return b'OK'
+
+	def command_cv_stop(self, args):
+		self.sweep_running = False # The DAC keeps its last value
+		return b'OK'
+
+	def sweep_service(self):
+		if not self.sweep_running or self.ticks() < self.next_sweep_step:
+			return
+		self.next_sweep_step += self.sweep_period
+		if self.sweep_position == self.sweep_target: # End of a leg
+			if self.sweep_legs_left == 0:
+				self.sweep_running = False # Sweep finished
+				return
+			self.sweep_legs_left -= 1
+			if self.sweep_legs_left == 0:
+				self.sweep_target = self.sweep_stop
+			else:
+				self.sweep_target = self.sweep_vertex[1] if self.sweep_target == self.sweep_vertex[0] else self.sweep_vertex[0]
+		if self.sweep_target > self.sweep_position:
+			self.sweep_position = min(self.sweep_position+self.sweep_step, self.sweep_target)
+		else:
+			self.sweep_position = max(self.sweep_position-self.sweep_step, self.sweep_target)
+		self.write_dac_code(self.sweep_position)
+
+	def command_wave_data(self, wave_data):
+		count = min(wave_data[0], wave_chunk_codes)
+		accepted = 0
+		while accepted < count and len(self.wave_fifo) < wave_fifo_size:
+			self.wave_fifo.append(wave_data[1+3*accepted:4+3*accepted])
+			accepted += 1
+		return bytes([accepted, wave_fifo_size-len(self.wave_fifo)])
+
+	def command_wave_start(self, wave_data):
+		if self.dac_cal_busy():
+			return b'BUSY'
+		self.wave_period = max(1, uint16(wave_data[0:2])) # One tick is the shortest period
+		self.wave_codes_left = int.from_bytes(wave_data[2:6], 'big')
+		self.wave_underruns = 0
+		self.next_wave_step = self.ticks()+1
+		self.sweep_running = False # The sweep and the waveform playback both drive the DAC
+		self.wave_running = self.wave_codes_left > 0
+		return b'OK'
+
+	def command_wave_stop(self, args):
+		self.wave_running = False # The DAC keeps its last value
+		self.wave_fifo.clear()
+		return b'OK'
+
+	def command_wave_status(self, args):
+		return bytes([wave_fifo_size-len(self.wave_fifo), self.wave_underruns])+self.wave_codes_left.to_bytes(4, 'big')
+
+	def wave_service(self):
+		if not self.wave_running or self.ticks() < self.next_wave_step:
+			return
+		self.next_wave_step += self.wave_period
+		if len(self.wave_fifo) == 0:
+			self.wave_underruns = (self.wave_underruns+1)%256 # The DAC holds its value; the rest of the waveform is delayed by one period
+			return
+		self.write_dac(self.wave_fifo.popleft())
+		self.wave_codes_left -= 1
+		if self.wave_codes_left == 0:
+			self.wave_running = False # Waveform finished
+
+	def command_calibrate_dac(self, args):
+		if self.dac_cal_running or self.sweep_running or self.wave_running or self.cd_running: # Refused while anything else drives the DAC
+			return b'BUSY'
+		self.dac_cal_started = self.ticks()
+		self.dac_cal_running = True
+		return b'OK'
+
+	def dac_cal_service(self):
+		if not self.dac_cal_running or self.ticks()-self.dac_cal_started < dac_selfcal_time:
+			return
+		self.dac_registers = dac_selfcal_result
+		self.calibration_blocks[1] = self.dac_registers
+		self.dac_cal_running = False
+
+	def command_cal_status(self, args):
+		if self.dac_cal_running:
+			self.perf_event(0)
+			return b'WAIT'
+		return b'OK'
+
+	def command_read_adc(self, args):
+		if self.streaming_enabled or self.cd_running:
+			return b'BUSY' # stream_service() owns the ADC
+		data = self.adc.read(timeit.default_timer())
+		if data is None:
+			self.perf_event(0)
+			return b'WAIT'
+		return data
+
+	def acquisition_start(self):
+		self.conversion_running = True # A conversion may still be running from polled mode...
+		self.conversion_discard = True # ...so wait for it and drop the result
+		self.next_acquisition = self.ticks()
+
+	def command_stream_start(self, args):
+		self.stream_frame_counter = 0
+		self.stream_ring.clear()
+		self.stream_overflows = 0
+		self.stream_latency = stream_default_latency
+		self.decimation = 1
+		self.decimation_count = 0
+		if not self.cd_running:
+			self.acquisition_start()
+		self.streaming_enabled = True
+		return b'OK'
+
+	def command_stream_stop(self, args):
+		self.streaming_enabled = False
+		return b'OK'
+
+	def command_stream_latency(self, latency_data):
+		self.stream_latency = uint16(latency_data)
+		return b'OK'
+
+	def command_stream_period(self, period_data):
+		self.acquisition_period = max(1, uint16(period_data)) # One tick is the shortest period
+		return b'OK'
+
+	def stream_flags(self):
+		flags = self.current_range
+		if self.conversion_invalid:
+			flags |= stream_flag_invalid
+		if self.galvanostatic:
+			flags |= stream_flag_galvanostatic
+		if self.cell_on:
+			flags |= stream_flag_cell_on
+		if self.sweep_running or self.wave_running:
+			flags |= stream_flag_sweep
+		if self.cd_running:
+			flags |= stream_flag_cd
+			if self.cd_phase:
+				flags |= stream_flag_cd_phase
+		return flags
+
+	def command_cd_start(self, cd_data):
+		if self.dac_cal_busy():
+			return b'BUSY'
+		if cd_data[3] > 2 or cd_data[11] > 2:
+			return b'?'
+		self.cd_phases = [{"dac": cd_data[8*i:8*i+3], "range": cd_data[8*i+3], "limit": int24(cd_data[8*i+4:8*i+7]), "rising": cd_data[8*i+7]} for i in range(2)]
+		self.cd_half_cycles_left = uint16(cd_data[16:18])
+		self.cd_idle_dac = cd_data[18:21]
+		self.cd_cell_off_when_done = cd_data[21]
+		self.cd_phase = 0 # The host has already applied the setpoint of the first phase
+		if not self.streaming_enabled and not self.cd_running:
+			self.acquisition_start() # The limits are checked on every conversion, whether or not they reach the host
+		self.cd_running = self.cd_half_cycles_left > 0
+		return b'OK'
+
+	def command_cd_stop(self, args):
+		self.cd_running = False # The DAC and cell keep their state
+		return b'OK'
+
+	def cd_service(self, adc_data):
+		if not self.cd_running:
+			return
+		potential = mcp3550_to_int(adc_data)
+		phase = self.cd_phases[self.cd_phase]
+		if (potential <= phase["limit"]) if phase["rising"] else (potential >= phase["limit"]):
+			return # Limit not crossed
+		self.cd_half_cycles_left -= 1
+		if self.cd_half_cycles_left == 0:
+			self.write_dac(self.cd_idle_dac)
+			if self.cd_cell_off_when_done:
+				self.command_cell_off(None)
+			self.cd_running = False
+			return
+		self.cd_phase ^= 1
+		self.set_current_range(self.cd_phases[self.cd_phase]["range"])
+		self.write_dac(self.cd_phases[self.cd_phase]["dac"])
+
+	def command_autorange(self, autorange_data):
+		self.autorange_mask = autorange_data[0]
+		self.autorange_offset = int24(autorange_data[1:4])
+		self.autorange_upper = [int24(autorange_data[4+6*i:7+6*i]) for i in range(3)]
+		self.autorange_lower = [int24(autorange_data[7+6*i:10+6*i]) for i in range(3)]
+		self.autorange_count = autorange_data[22]
+		self.autorange_over = 0
+		self.autorange_under = 0
+		return b'OK'
+
+	def autorange_service(self, adc_data):
+		# In galvanostatic mode, the range sets the applied current, so it is left alone
+		if not self.autorange_mask or self.galvanostatic or self.cd_running or self.conversion_invalid:
+			return
+		current = abs(mcp3550_to_int(adc_data[3:6])-self.autorange_offset)
+		if current > self.autorange_upper[self.current_range] and self.current_range != 0 and self.autorange_mask & (1 << (self.current_range-1)):
+			self.autorange_over += 1
+		else:
+			self.autorange_over = 0
+		if current < self.autorange_lower[self.current_range] and self.current_range != 2 and self.autorange_mask & (1 << (self.current_range+1)):
+			self.autorange_under += 1
+		else:
+			self.autorange_under = 0
+		if self.autorange_over > self.autorange_count:
+			self.set_current_range(self.current_range-1)
+			self.autorange_over = 0
+		elif self.autorange_under > self.autorange_count:
+			self.set_current_range(self.current_range+1)
+			self.autorange_under = 0
+
+	def stream_run_length(self):
+		"""Return the number of samples at the start of the ring buffer that fit in a single frame (identical flags and decimation, consecutive acquisition slots)."""
+		first_tick, first_flags, first_decimation, data = self.stream_ring[0]
+		length = 0
+		for tick, flags, decimation, data in self.stream_ring:
+			if length == stream_max_samples or flags != first_flags or decimation != first_decimation or tick != first_tick+length*first_decimation*self.acquisition_period:
+				break
+			length += 1
+		return length
+
+	def stream_ship_frame(self, count):
+		first_tick, flags, decimation, data = self.stream_ring[0]
+		frame = bytes([stream_frame_marker, self.stream_frame_counter, count, flags])+(first_tick%2**32).to_bytes(4, 'little')+bytes([decimation, self.stream_overflows])
+		for i in range(count):
+			frame += self.stream_ring.popleft()[3]
+		self.stream_frame_counter = (self.stream_frame_counter+1)%256
+		self.in_packets.append(frame)
+		self.lock.notify_all()
+
+	def stream_store_sample(self, adc_data, tick, flags):
+		if not self.streaming_enabled:
+			return
+		if len(self.stream_ring) == self.stream_ring_size:
+			self.stream_overflows = (self.stream_overflows+1)%256
+			self.perf_event(2)
+			return
+		self.stream_ring.append((tick, flags, self.decimation, adc_data))
+
+	def command_decimation(self, decimation_data):
+		self.decimation = decimation_data[0] if decimation_data[0] else 1
+		self.decimation_count = 0
+		return b'OK'
+
+	def stream_decimate(self, adc_data):
+		flags = self.stream_flags()
+		if self.decimation == 1:
+			self.stream_store_sample(adc_data, self.conversion_started, flags)
+			return
+		if self.decimation_count > 0 and flags != self.decimation_flags:
+			self.decimation_count = 0 # The partial block is dropped
+		if self.decimation_count == 0:
+			self.decimation_flags = flags
+			self.decimation_tick = self.conversion_started
+			self.decimation_sum = [0, 0]
+		self.decimation_sum[0] += mcp3550_to_int(adc_data[0:3])
+		self.decimation_sum[1] += mcp3550_to_int(adc_data[3:6])
+		self.decimation_count += 1
+		if self.decimation_count < self.decimation:
+			return
+		self.decimation_count = 0
+		averaged_data = b''.join(int_to_mcp3550(int(value/self.decimation)) for value in self.decimation_sum) # Rounds towards zero, like the integer division in C
+		self.stream_store_sample(averaged_data, self.decimation_tick, flags)
+
+	def stream_service(self):
+		now = self.ticks()
+		if self.streaming_enabled and len(self.stream_ring) > 0 and not self.delay_pending and not self.in_endpoint_busy(): # While a DELAY is pending, the EP1 IN buffer holds the partial reply
+			run_length = self.stream_run_length()
+			# Ship when the frame is full, cannot be extended any further, or its oldest sample has waited long enough
+			if run_length == stream_max_samples or run_length < len(self.stream_ring) or now-self.stream_ring[0][0] >= self.stream_latency:
+				self.stream_ship_frame(run_length)
+		if not self.conversion_running:
+			if now < self.next_acquisition:
+				return # Next acquisition slot not reached yet
+			if now-self.next_acquisition >= self.acquisition_period: # One or more acquisition slots were missed
+				self.next_acquisition += (now-self.next_acquisition)//self.acquisition_period*self.acquisition_period
+			self.adc.start(timeit.default_timer())
+			self.conversion_started = self.next_acquisition
+			self.conversion_invalid = self.relay_switching
+			self.next_acquisition += self.acquisition_period
+			self.conversion_running = True
+		else:
+			adc_data = self.adc.read_result(timeit.default_timer())
+			if adc_data is None:
+				return # Conversion not finished yet
+			self.conversion_running = False
+			if self.conversion_discard:
+				self.conversion_discard = False
+				return
+			self.stream_decimate(adc_data)
+			self.cd_service(adc_data)
+			self.autorange_service(adc_data)
+
+	def command_delay(self, delay_data):
+		if uint16(delay_data) > max_delay:
+			return b'?'
+		self.delay_end = self.ticks()+uint16(delay_data)
+		self.delay_pending = True # The rest of the batch and the reply are held back, while the services keep running
+		return b'OK'
+
+	def command_read_offset(self, args):
+		return self.calibration_blocks[0]
+
+	def command_save_offset(self, offset_data):
+		self.calibration_blocks[0] = bytes(offset_data)
+		return b'OK'
+
+	def command_read_shuntcalibration(self, args):
+		return self.calibration_blocks[2]
+
+	def command_save_shuntcalibration(self, shuntcalibration_data):
+		self.calibration_blocks[2] = bytes(shuntcalibration_data)
+		return b'OK'
+
+	def command_read_dac_cal(self, args):
+		return self.calibration_blocks[1]
+
+	def command_read_calibration(self, args):
+		return b''.join(self.calibration_blocks)
+
+	def command_set_dac_cal(self, dac_cal_data):
+		if self.dac_cal_busy():
+			return b'BUSY'
+		self.calibration_blocks[1] = bytes(dac_cal_data)
+		self.dac_registers = bytes(dac_cal_data)
+		return b'OK'
+
+	def command_set_serial(self, serial_data):
+		serial = b''
+		for byte in serial_data: # Up to the first non-printable character (see usb_set_serial_number())
+			if byte < 0x20 or byte > 0x7E:
+				break
+			serial += bytes([byte])
+		if len(serial) > 0:
+			self.serial_number = serial.decode()
+		return b'OK'
+
+	# Performance counters, as in firmware built with "make STATS=1"
+
+	def perf_record(self, counter, elapsed):
+		"""Add a measurement of elapsed host time (in s) to a counter, in counts of the firmware's Timer1; like its 16-bit timer readings, longer times wrap around."""
+		counts = int(elapsed/engine.perf_timer_period)%2**16
+		counter = self.perf_counters[counter]
+		if counter[0] == 0xFFFF:
+			return # The average would no longer be exact
+		if counter[0] == 0 or counts < counter[1]:
+			counter[1] = counts
+		counter[2] = max(counter[2], counts)
+		counter[3] = (counter[3]+counts)%2**32
+		counter[0] += 1
+
+	def perf_event(self, event):
+		if self.stats:
+			self.perf_events[event] = (self.perf_events[event]+1)%2**16
+
+	def command_stats(self, args):
+		index = args[0]
+		if index < perf_counters:
+			count, minimum, maximum, total = self.perf_counters[index]
+			return count.to_bytes(2, 'big')+minimum.to_bytes(2, 'big')+maximum.to_bytes(2, 'big')+total.to_bytes(4, 'big')
+		if command_opcode_base <= index < command_opcode_base+len(self.commands):
+			self.perf_command = index-command_opcode_base
+			self.perf_counters[perf_command] = [0, 0, 0, 0]
+			return b'OK'
+		if index == perf_stats_events:
+			return b''.join(event.to_bytes(2, 'big') for event in self.perf_events)+bytes([0 if self.perf_command is None else command_opcode_base+self.perf_command])
+		if index == perf_stats_reset:
+			self.perf_counters = [[0, 0, 0, 0] for i in range(perf_counters)]
+			self.perf_events = [0, 0, 0]
+			return b'OK'
+		return b'?'
+
+def open_device(serial=None, **options):
+	"""Create an emulated device (see EmulatedDevice for the options) and return it connected as a tdstatv3_engine.Device, in the same state as open_device() in tdstatv3_engine."""
+	device = engine.Device(EmulatedDevice(serial if serial is not None else engine.default_serial_number, **options))
+	device.connect()
+	return device
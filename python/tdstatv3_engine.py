@@ -0,0 +1,1006 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+# This Python module contains everything needed to control the USB potentiostat/galvanostat without a graphical user interface: the USB command protocol, decoding of
+# streamed data, calibration math, buffered data storage, and measurement techniques that run on the device's own sweep engine and charge/discharge controller.
+# It is used by the GUI (tdstatv3.py) and by the command-line tool (tdstatv3_cli.py), and can be imported by scripts. It requires only Python 3.x with the Numpy and PyUSB packages.
+
+# Author: Thomas Dobbelaere
+# License: GPL
+
+import time, timeit
+import usb.core, usb.util
+import os
+import errno
+import collections
+import threading, queue
+import json
+import numpy
+
+usb_vid = 0xa0a0 # Default USB vendor ID
+usb_pid = 0x0002 # Default USB product ID
+serial_number_length = 8 # Maximum length of the serial number stored in the device's flash memory
+default_serial_number = "0001" # Serial number reported by boards that have not been given one; such boards are not told apart by the calibration cache
+calibration_cache_filename = os.path.join(os.path.expanduser("~"), ".tdstatv3_calibration.json") # Calibration values per serial number, so that reconnecting does not need to read them from flash memory
+current_range_list = ["20 mA", u"200 µA", u"2 µA"]
+command_opcodes = [(b'CELL ON',0), (b'CELL OFF',0), (b'POTENTIOSTATIC',0), (b'GALVANOSTATIC',0), (b'RANGE 1',0), (b'RANGE 2',0), (b'RANGE 3',0), (b'DACSET ',3), (b'DACCAL',0), (b'ADCREAD',0), (b'OFFSETREAD',0), (b'OFFSETSAVE ',6), (b'DACCALGET',0), (b'DACCALSET ',6), (b'SHUNTCALREAD',0), (b'SHUNTCALSAVE ',6), (b'STREAM START',0), (b'STREAM STOP',0), (b'STREAM LATENCY ',2), (b'STREAM PERIOD ',2), (b'CVSWEEP ',19), (b'CVSTOP',0), (b'CDSTART ',22), (b'CDSTOP',0), (b'DELAY ',2), (b'AUTORANGE ',23), (b'DECIMATION ',1), (b'SERIALSET ',8), (b'WAVEDATA ',61), (b'WAVESTART ',6), (b'WAVESTOP',0), (b'WAVESTATUS',0), (b'CALREAD',0), (b'CALSTATUS',0), (b'STATS ',1)] # ASCII command names and payload lengths, in the order of the firmware's command table (checked by test_command_table.py); the binary opcode is 0x80 plus the index in this list
+usb_timeout_errnos = (errno.ETIMEDOUT, 110, 116) # Error numbers reported for read timeouts by the various PyUSB backends
+usb_read_timeout = 100 # Time (in ms) the USB reader thread waits for a packet before checking whether it should stop
+usb_reply_timeout = 1. # Time (in s) to wait for the reply to a command, on top of the time it is held back by DELAY commands
+dac_calibration_poll_interval = 0.1 # Time (in s) between two checks whether the DAC self-calibration has finished
+dac_calibration_timeout = 5. # Maximum time (in s) to wait for the DAC self-calibration
+stream_frame_marker = 0xA5 # First byte of a data frame pushed by the firmware in streaming mode
+stream_flag_sweep = 0x10 # Data frame flag indicating that the device's CV sweep engine is running
+stream_flag_cd = 0x20 # Data frame flag indicating that the device's charge/discharge controller is running
+stream_flag_cd_phase = 0x40 # Data frame flag indicating that the device's charge/discharge controller is in its second phase
+stream_flag_invalid = 0x80 # Data frame flag indicating that the samples were taken while the range relays were switching
+stream_queue_length = 10000 # Maximum number of samples waiting in a device's sample queue; further samples are dropped
+stream_latency = 100 # Default time (in ms) the device may hold back samples to pack them into fewer data frames, as set by STREAM START
+acquisition_period = 90 # Default time (in ms) between two conversions started by the device clock in streaming mode; must exceed the MCP3550 conversion time of about 80 ms
+cv_step_period = 0.05 # Time (in s) between two DAC steps when the host steps the CV sweep itself
+cv_min_step_period = 1 # Shortest time (in ms) between two DAC steps of the device's sweep engine, which is timed by the 1 ms device clock
+cv_scan_rate_tolerance = 0.01 # Largest relative deviation from the requested scan rate accepted when choosing the device's DAC step size and step period
+waveform_chunk_codes = 20 # Number of DAC codes in a single WAVEDATA command
+waveform_poll_interval = 0.005 # Time (in s) between two checks of the device's waveform FIFO during playback
+perf_timer_period = 4/12e6 # Time (in s) per count of the timer behind the firmware's performance counters (Timer1 at Fosc/16)
+perf_counter_names = ["adc_read", "dac_write", "usb_service", "interpret", "command"] # Firmware performance counters, in the order of their STATS argument; "command" times the command selected with select_stats_command()
+log_flush_records = 1000 # Number of buffered log records that triggers a write to disk
+log_flush_interval = 1. # Maximum time (in s) that log records are kept in memory before being written to disk
+log_record_dtype = numpy.dtype([('time','<f8'),('raw_potential','<i4'),('raw_current','<i4'),('range','u1')]) # One log record: time (in s), raw ADC counts, and current range index
+log_header_marker = 0xFFFFFFFF # Block length value that marks a calibration header instead of a block of records
+log_header_dtype = numpy.dtype([('potential_offset','<f8'),('current_offset','<f8'),('shunt_calibration','<f8',(3,))]) # Calibration constants needed to convert the raw log records
+output_flush_interval = 1. # Time (in s) between two batched writes of the measurement output files
+messages = collections.deque() # Messages from background threads (USB readers, output writers), waiting to be shown by the user interface
+
+class DeviceError(Exception):
+	"""Raised when the device gives an unexpected reply to a command."""
+	pass
+
+def twocomplement_to_decimal(msb, middlebyte, lsb):
+	"""Convert a 22-bit two-complement ADC value consisting of three bytes to a signed integer (see MCP3550 datasheet for details)."""
+	ovh = (msb > 63) and (msb < 128) # Check for overflow high (B22 set)
+	ovl = (msb > 127) # Check for overflow low (B23 set)
+	combined_value = (msb%64)*2**16+middlebyte*2**8+lsb # Get rid of overflow bits
+	if not ovh and not ovl:
+		if msb > 31: # B21 set -> negative number
+			answer = combined_value - 2**22
+		else:
+			answer = combined_value
+	else: # overflow
+		if msb > 127: # B23 set -> negative number
+			answer = combined_value - 2**22
+		else:
+			answer = combined_value
+	return answer
+
+def adc_bytes_to_array(data):
+	"""Convert a buffer of consecutive 3-byte ADC values (see twocomplement_to_decimal) to a NumPy array of signed integers in a single pass."""
+	values = numpy.frombuffer(data, dtype=numpy.uint8).reshape(-1,3).astype(numpy.int32)
+	msb = values[:,0]
+	combined_values = (msb%64)*2**16+values[:,1]*2**8+values[:,2] # Get rid of overflow bits
+	negative = (msb > 127) | ((msb < 64) & (msb > 31)) # B23 set (overflow low), or no overflow and B21 set
+	return combined_values-negative*2**22
+
+def decimal_to_dac_codes(values):
+	"""Convert a floating-point number or an array of them, ranging from -2**19 to 2**19-1, to an array holding three data bytes per value in the proper format for the DAC1220."""
+	code = 2**19 + numpy.round(numpy.asarray(values, dtype=float)).astype(numpy.int64) # Convert the (signed) input values to unsigned 20-bit integers with zero at midway
+	code = numpy.clip(code, 0, 2**20 - 1) # If the input exceeds the boundaries of the 20-bit integer, clip it
+	return numpy.stack([code // 2**12, (code % 2**12) // 2**4, (code % 2**4)*2**4], axis=-1).astype(numpy.uint8)
+
+def decimal_to_dac_bytes(value):
+	"""Convert a floating-point number, ranging from -2**19 to 2**19-1, to three data bytes in the proper format for the DAC1220; an array of numbers yields three bytes per value."""
+	return decimal_to_dac_codes(value).tobytes()
+
+def dac_bytes_to_decimal(dac_bytes):
+	"""Convert three data bytes in the DAC1220 format to a 20-bit number ranging from -2**19 to 2**19-1."""
+	code = 2**12*dac_bytes[0]+2**4*dac_bytes[1]+dac_bytes[2]/2**4
+	return code - 2**19
+
+def float_to_twobytes(value):
+	"""Convert a floating-point number ranging from -2^15 to 2^15-1 to a 16-bit representation stored in two bytes."""
+	code = 2**15 + int(round(value))
+	code = numpy.clip(code, 0, 2**16 - 1) # If the code exceeds the boundaries of a 16-bit integer, clip it
+	byte1 = code // 2**8
+	byte2 = code % 2**8
+	return bytes([byte1,byte2])
+
+def twobytes_to_float(bytes_in):
+	"""Convert two bytes to a number ranging from -2^15 to 2^15-1."""
+	code = 2**8*bytes_in[0]+bytes_in[1]
+	return float(code - 2**15)
+
+def current_range_from_current(current):
+	"""Return the current range that best corresponds to a given current (in mA)."""
+	current = abs(current)
+	if current <= 0.002:
+		return 2 # Lowest current range (2 uA)
+	elif current <= 0.2:
+		return 1 # Intermediate current range (200 uA)
+	else:
+		return 0 # Highest current range (20 mA)
+
+class Calibration:
+	"""Hold the offset and shunt calibration of a device, and convert between physical units and raw ADC/DAC values."""
+	def __init__(self):
+		self.potential_offset = 0. # Potential offset in DAC counts
+		self.current_offset = 0. # Current offset in DAC counts
+		self.shunt_calibration = [1.,1.,1.] # Fine adjustment for shunt resistors, containing values of R1/10ohm, R2/1kohm, R3/100kohm
+
+	def adc_to_potential(self, raw_value):
+		"""Convert raw potential ADC counts (a number or a NumPy array) to a potential in V, compensating for offset."""
+		return (raw_value-self.potential_offset)/2097152.*8.
+
+	def adc_to_current(self, raw_value, range_index):
+		"""Convert raw current ADC counts (a number or a NumPy array) to a current in mA, taking the current range into account and compensating for offset."""
+		return (raw_value-self.current_offset)/2097152.*25./(self.shunt_calibration[range_index]*100.**range_index)
+
+	def potential_to_dac_codes(self, values):
+		"""Convert a potential (in V) or an array of potentials to an array of DAC bytes (see decimal_to_dac_codes), compensating for the potential offset."""
+		return decimal_to_dac_codes(numpy.asarray(values, dtype=float)/8.*2.**19+int(round(self.potential_offset/4.)))
+
+	def potential_to_dac_bytes(self, value):
+		"""Convert a potential (in V) to DAC bytes, compensating for the potential offset."""
+		return self.potential_to_dac_codes(value).tobytes()
+
+	def current_to_dac_bytes(self, value, range_index):
+		"""Convert a current (in mA) to DAC bytes for a given current range, compensating for the current offset."""
+		return decimal_to_dac_bytes(value/(25./(self.shunt_calibration[range_index]*100.**range_index))*2.**19+int(round(self.current_offset/4.)))
+
+	def potential_to_adc_bytes(self, value):
+		"""Convert a potential (in V) to a raw ADC value in 24-bit two's complement, compensating for the potential offset."""
+		return (int(round(value/8.*2097152.+self.potential_offset))%2**24).to_bytes(3, 'big')
+
+def cv_sweep_command(calibration, startpot, ubound, lbound, stoppot, scanrate, numcycles):
+	"""Return the CVSWEEP command that lets the device's sweep engine run a staircase CV with the given potentials (in V) and scan rate (in V/s)."""
+	if scanrate > 0: # The sweep engine reverses at the vertices in the order given
+		vertices = [ubound, lbound]
+	else:
+		vertices = [lbound, ubound]
+	dac_step, step_period = cv_sweep_steps(scanrate)
+	numcycles = int(numpy.clip(numcycles, 0, 2**16-1))
+	return b'CVSWEEP '+calibration.potential_to_dac_bytes(startpot)+calibration.potential_to_dac_bytes(vertices[0])+calibration.potential_to_dac_bytes(vertices[1])+calibration.potential_to_dac_bytes(stoppot)+decimal_to_dac_bytes(dac_step-2**19)+bytes([step_period//256, step_period%256, numcycles//256, numcycles%256])
+
+def cv_sweep_steps(scanrate):
+	"""Return the DAC step size (in DAC counts) and step period (in ms) of the device's sweep engine for a scan rate (in V/s).
+	The step period is the shortest one, down to a single device clock tick, that yields the scan rate within cv_scan_rate_tolerance, so the staircase is as fine as possible."""
+	counts_per_tick = abs(scanrate)*1e-3/8.*2**19 # DAC counts per millisecond at the requested scan rate
+	step_period = int(numpy.clip(1./counts_per_tick, cv_min_step_period, 2**16-1)) # Shorter periods would need steps of less than one DAC count
+	dac_step = max(1, int(round(counts_per_tick*step_period)))
+	while step_period < 2**16-1 and abs(dac_step/step_period/counts_per_tick-1.) > cv_scan_rate_tolerance:
+		step_period += 1
+		dac_step = max(1, int(round(counts_per_tick*step_period)))
+	return min(dac_step, 2**19-1), step_period
+
+def cd_start_command(calibration, currents, numhalfcycles, ubound, lbound, final_range, cell_off_when_done):
+	"""Return the CDSTART command that lets the device switch between two currents (in mA) by itself whenever a potential limit is crossed, for a given number of half cycles."""
+	payload = b''
+	for setpoint in currents:
+		range_index = current_range_from_current(setpoint)
+		rising = setpoint > 0 # A positive current ends at the upper bound, a negative current at the lower bound
+		payload += calibration.current_to_dac_bytes(setpoint, range_index)+bytes([range_index])+calibration.potential_to_adc_bytes(ubound if rising else lbound)+bytes([rising])
+	numhalfcycles = int(numpy.clip(numhalfcycles, 1, 2**16-1))
+	payload += bytes([numhalfcycles//256, numhalfcycles%256])+calibration.current_to_dac_bytes(0., final_range)+bytes([cell_off_when_done]) # After the last half cycle, the device applies zero current and optionally switches the cell off
+	return b'CDSTART '+payload
+
+def autorange_command(calibration, enabled_ranges):
+	"""Return the AUTORANGE command that lets the device switch between the given current ranges by itself (an empty list disables autoranging)."""
+	mask = sum(1<<i for i in enabled_ranges) # Current ranges the device may switch to
+	payload = bytes([mask])+(int(round(calibration.current_offset))%2**24).to_bytes(3, 'big')
+	for i in range(3):
+		full_scale = 20./25.*2097152.*calibration.shunt_calibration[i] # Raw ADC counts (relative to the offset) at the nominal full scale of current range i
+		payload += int(1.05*full_scale).to_bytes(3, 'big')+int(0.0095*full_scale).to_bytes(3, 'big')
+	payload += bytes([3]) # Switch after more than three detections
+	return b'AUTORANGE '+payload
+
+def cv_sweep(time_elapsed, ustart, ustop, ubound, lbound, scanrate, n):
+	"""Generate the potential profile for a cyclic voltammetry sweep.
+
+	Keyword arguments:
+	time_elapsed -- an array of elapsed times
+	ustart -- the start potential
+	ustop -- the stop potential
+	ubound -- the upper potential bound
+	lbound -- the lower potential bound
+	scanrate -- the scan rate
+	n -- the number of scans
+
+	Returns an array with the potential at each of the elapsed times; times beyond the end of the CV sweep yield NaN.
+	"""
+	if scanrate < 0: # The rest of the function assumes a positive scan rate; a negative one is handled here by recursion
+		return -cv_sweep(time_elapsed, -ustart, -ustop, -lbound, -ubound, -scanrate, n) # Re-run the function with inverted potentials and scan rates and invert the result
+	srt_0 = ubound-ustart # Potential difference to traverse in the initial stage (before potential reaches upper bound)
+	srt_1 = (ubound-lbound)*2.*n # Potential difference to traverse in the "cyclic stage" (repeated scans from upper to lower bound and back)
+	srt_2 = abs(ustop-ubound) # Potential difference to traverse in the final stage (from upper bound to stop potential)
+	srtime = scanrate*numpy.asarray(time_elapsed, dtype=float) # Linear potential sweep
+	initial = ustart+srtime
+	cyclic = lbound + numpy.abs((srtime-srt_0)%(2*(ubound-lbound))-(ubound-lbound))
+	final = ubound + (srtime-srt_0-srt_1)*(1. if ustop > ubound else -1.)
+	return numpy.select([srtime < srt_0, srtime < srt_0+srt_1, srtime < srt_0+srt_1+srt_2], [initial, cyclic, final], numpy.nan) # The stage is chosen per element; NaN signifies that the CV has finished
+
+def cv_duration(ustart, ustop, ubound, lbound, scanrate, n):
+	"""Return the duration (in s) of the cyclic voltammetry sweep generated by cv_sweep()."""
+	if scanrate < 0:
+		return cv_duration(-ustart, -ustop, -lbound, -ubound, -scanrate, n)
+	return ((ubound-ustart)+(ubound-lbound)*2.*n+abs(ustop-ubound))/scanrate
+
+class CVWaveform:
+	"""The potential profile of a CV sweep sampled at fixed time steps, together with the corresponding DAC codes, computed once before the measurement.
+	The table can be plotted as a preview, looked up while stepping the DAC from the host, or uploaded to the device in chunks."""
+	def __init__(self, calibration, ustart, ustop, ubound, lbound, scanrate, n, timestep=cv_step_period):
+		self.timestep = timestep
+		self.duration = cv_duration(ustart, ustop, ubound, lbound, scanrate, n)
+		time_arr = numpy.arange(0., self.duration, timestep)
+		potential_arr = cv_sweep(time_arr, ustart, ustop, ubound, lbound, scanrate, n)
+		valid = ~numpy.isnan(potential_arr) # Rounding may push the last time step just past the end of the sweep
+		self.time = time_arr[valid]
+		self.potential = potential_arr[valid]
+		self.dac_codes = calibration.potential_to_dac_codes(self.potential) # One row of three DAC bytes per time step
+
+	def __len__(self):
+		return len(self.time)
+
+	def index_at(self, time_elapsed):
+		"""Return the index of the time step that is closest to the elapsed time (in s), or None if the CV sweep has finished."""
+		if time_elapsed >= self.duration:
+			return None
+		return min(int(round(time_elapsed/self.timestep)), len(self.time)-1)
+
+	def dac_bytes(self, index):
+		"""Return the DAC bytes of a given time step, as used by the DACSET command."""
+		return self.dac_codes[index].tobytes()
+
+	def chunks(self, codes_per_chunk):
+		"""Return the DAC codes as a list of byte strings, each holding up to codes_per_chunk codes, for uploading to the device."""
+		return [self.dac_codes[i:i+codes_per_chunk].tobytes() for i in range(0, len(self.dac_codes), codes_per_chunk)]
+
+def charge_from_cv(time_arr, current_arr):
+	"""Integrate current as a function of time to calculate charge between zero crossings."""
+	zero_crossing_indices = []
+	charge_arr = []
+	running_index = 0
+	while running_index < len(current_arr):
+		counter = 0
+		while running_index < len(current_arr) and current_arr[running_index] >= 0.: # Iterate over a block of positive currents
+			running_index += 1
+			counter += 1
+		if counter >= 10: # Check if the block holds at least 10 values (this makes the counting immune to noise around zero crossings)
+			zero_crossing_indices.append(running_index-counter) # If so, append the index of the start of the block to the list of zero-crossing indices
+		counter = 0
+		while running_index < len(current_arr) and current_arr[running_index] <= 0.: # Do the same for a block of negative currents
+			running_index += 1
+			counter += 1
+		if counter >= 10:
+			zero_crossing_indices.append(running_index-counter)
+	for index in range(0,len(zero_crossing_indices)-1): # Go over all zero crossings
+		zc_index1 = zero_crossing_indices[index] # Start index
+		zc_index2 = zero_crossing_indices[index+1] # End index
+		charge_arr.append(numpy.trapz(current_arr[zc_index1:zc_index2],time_arr[zc_index1:zc_index2])*1000./3.6) # Integrate current over time using the trapezoid rule, convert coulomb to uAh
+	return charge_arr
+
+class TimeSeries:
+	"""Hold a growing series of values in a preallocated NumPy array, which is enlarged in chunks so that appending a value takes constant (amortized) time."""
+	chunk_size = 4096 # Initial capacity, and minimum amount by which the capacity grows
+	def __init__(self):
+		self.clear()
+
+	def append(self, value):
+		if self.length == len(self.buffer): # Full, so double the capacity (this keeps the total copying cost linear in the number of values)
+			self.buffer = numpy.concatenate((self.buffer, numpy.empty(max(self.chunk_size, len(self.buffer)))))
+		self.buffer[self.length] = value
+		self.length += 1
+
+	def data(self):
+		"""Return a view (not a copy) of the values appended so far."""
+		return self.buffer[:self.length]
+
+	def clear(self):
+		self.buffer = numpy.empty(self.chunk_size)
+		self.length = 0
+
+class ChargeBuffer(TimeSeries):
+	"""Integrate current over time with the trapezoid rule one point at a time, holding the magnitude of the cumulative charge (in Ah) at every point."""
+	def add_point(self, time_value, current_value):
+		if self.length > 0:
+			self.charge += (current_value+self.last_current)/2.*(time_value-self.last_time)/3600.
+		self.last_time = time_value
+		self.last_current = current_value
+		self.append(abs(self.charge))
+
+	def clear(self):
+		TimeSeries.clear(self)
+		self.charge = 0. # Signed cumulative charge in Ah
+
+class AverageBuffer:
+	"""Collect samples and compute an average as soon as a sufficient number of samples is added."""
+	def __init__(self, number_of_samples_to_average):
+		self.number_of_samples_to_average = number_of_samples_to_average
+		self.samples = []
+		self.averages = TimeSeries()
+
+	@property
+	def averagebuffer(self):
+		"""All averages calculated so far, as a NumPy array."""
+		return self.averages.data()
+
+	def add_sample(self, sample):
+		self.samples.append(sample)
+		if len(self.samples) >= self.number_of_samples_to_average:
+			self.averages.append(sum(self.samples)/len(self.samples))
+			self.samples = []
+
+	def clear(self):
+		self.samples = []
+		self.averages.clear()
+
+class LogWriter:
+	"""Append measurements to a binary log file in blocks, instead of opening the file and formatting a line of text for every sample.
+	The file consists of blocks, each starting with a 4-byte little-endian length: log_header_marker followed by a calibration header (log_header_dtype), or a number of records followed by that many log_record_dtype records.
+	A calibration header is written whenever logging starts or the calibration is changed, so the raw records can always be converted to potential and current (see export_log_to_text)."""
+	def __init__(self, filename, calibration):
+		self.file = open(filename, 'ab')
+		self.source = calibration
+		self.records = numpy.zeros(log_flush_records, dtype=log_record_dtype)
+		self.length = 0
+		self.calibration = None
+		self.last_flush = timeit.default_timer()
+
+	def add_record(self, time_value, raw_potential_value, raw_current_value, range_index):
+		calibration = (self.source.potential_offset, self.source.current_offset, tuple(self.source.shunt_calibration))
+		if calibration != self.calibration: # The records that follow need a new calibration header
+			self.flush()
+			header = numpy.array([calibration], dtype=log_header_dtype)
+			self.file.write(numpy.uint32(log_header_marker).tobytes()+header.tobytes())
+			self.calibration = calibration
+		self.records[self.length] = (time_value, raw_potential_value, raw_current_value, range_index)
+		self.length += 1
+		if self.length == len(self.records) or timeit.default_timer()-self.last_flush > log_flush_interval:
+			self.flush()
+
+	def flush(self):
+		"""Write the buffered records to disk."""
+		if self.length > 0:
+			self.file.write(numpy.uint32(self.length).tobytes()+self.records[:self.length].tobytes())
+			self.length = 0
+		self.file.flush()
+		self.last_flush = timeit.default_timer()
+
+	def close(self):
+		self.flush()
+		self.file.close()
+
+class OutputWriter(threading.Thread):
+	"""Write rows of measurement data to a tab-separated text file from a background thread, formatting the rows collected since the previous write in a single batch."""
+	def __init__(self, filename, header, row_format="%e"):
+		threading.Thread.__init__(self)
+		self.daemon = True
+		self.filename = filename
+		self.file = open(filename, 'w')
+		self.file.write(header+"\n")
+		self.row_format = row_format
+		self.rows = collections.deque() # Filled by the measurement thread, emptied by the writer thread
+		self.finished = threading.Event()
+		self.start()
+
+	def write(self, *values):
+		"""Queue a row of values; this costs no formatting or file access on the calling thread."""
+		self.rows.append(values)
+
+	def run(self):
+		try:
+			while not self.finished.wait(output_flush_interval):
+				self.write_rows()
+			self.write_rows()
+		except (IOError, OSError) as error:
+			messages.append("Error writing to %s: %s"%(self.filename, error))
+		self.file.close()
+
+	def write_rows(self):
+		rows = [self.rows.popleft() for i in range(len(self.rows))]
+		if len(rows) > 0:
+			numpy.savetxt(self.file, rows, fmt=self.row_format, delimiter="\t")
+			self.file.flush()
+			os.fsync(self.file.fileno()) # Make sure the data written so far survives a crash of the program or computer
+
+	def close(self):
+		"""Write the remaining rows and close the file."""
+		self.finished.set()
+		self.join()
+
+def export_log_to_text(log_filename, text_filename):
+	"""Convert a binary log file to tab-separated text containing time (in s), potential (in V), and current (in A); return the number of exported records."""
+	data = open(log_filename, 'rb').read()
+	output_file = open(text_filename, 'w')
+	position, numrecords = 0, 0
+	calibration = numpy.zeros(1, dtype=log_header_dtype)[0]
+	while position+4 <= len(data):
+		length = int(numpy.frombuffer(data, dtype='<u4', count=1, offset=position)[0])
+		position += 4
+		if length == log_header_marker:
+			if position+log_header_dtype.itemsize > len(data):
+				break # Incomplete block at the end of the file, e.g. after a crash
+			calibration = numpy.frombuffer(data, dtype=log_header_dtype, count=1, offset=position)[0]
+			position += log_header_dtype.itemsize
+			continue
+		if position+length*log_record_dtype.itemsize > len(data):
+			break
+		records = numpy.frombuffer(data, dtype=log_record_dtype, count=length, offset=position)
+		position += length*log_record_dtype.itemsize
+		potential_values = (records['raw_potential']-calibration['potential_offset'])/2097152.*8.
+		current_values = (records['raw_current']-calibration['current_offset'])/2097152.*25./(calibration['shunt_calibration'][records['range']]*100.**records['range'])*1e-3 # Convert mA to A
+		numpy.savetxt(output_file, numpy.column_stack((records['time'], potential_values, current_values)), fmt=["%.2f","%e","%e"], delimiter="\t")
+		numrecords += length
+	output_file.close()
+	return numrecords
+
+def decode_offset(response):
+	"""Convert an offset block (as returned by OFFSETREAD) to the potential and current offset, or None if none have been stored."""
+	if response == bytes([255,255,255,255,255,255]): # If no offset value has been stored, all bits will be set
+		return None
+	return dac_bytes_to_decimal(response[0:3]), dac_bytes_to_decimal(response[3:6])
+
+def decode_dac_calibration(response):
+	"""Convert a DAC calibration block (as returned by DACCALGET) to the DAC offset and gain, or None if none have been stored."""
+	if response == bytes([255,255,255,255,255,255]): # If no calibration value has been stored, all bits are set
+		return None
+	return dac_bytes_to_decimal(response[0:3]), dac_bytes_to_decimal(response[3:6])+2**19
+
+def decode_shunt_calibration(response):
+	"""Convert a shunt calibration block (as returned by SHUNTCALREAD) to the three shunt calibration values, or None if none have been stored."""
+	if response == bytes([255,255,255,255,255,255]): # If no calibration value has been stored, all bits are set
+		return None
+	return [1.+twobytes_to_float(response[2*i:2*i+2])/1e6 for i in range(0,3)] # Yields an adjustment range from 0.967 to 1.033 in steps of 1 ppm
+
+class CalibrationCache:
+	"""Calibration values of each device read so far, keyed by serial number and kept in a file, so that reconnecting a device does not need to read its flash memory.
+	Each entry holds the offsets, DAC calibration and shunt calibration (see Device.read_calibration())."""
+	def __init__(self, filename=calibration_cache_filename):
+		self.filename = filename
+		self.lock = threading.Lock() # Devices may be opened from several threads
+		try:
+			self.entries = json.load(open(filename))
+		except (IOError, OSError, ValueError):
+			self.entries = {} # No cache yet, or an unreadable one
+
+	def lookup(self, serial):
+		"""Return the cached calibration values of a device, or None if they are not known."""
+		if serial == default_serial_number or serial not in self.entries:
+			return None
+		entry = self.entries[serial]
+		return tuple(entry[key] for key in ("offset", "dac_calibration", "shunt_calibration"))
+
+	def store(self, serial, offsets, dac_calibration, shunt_calibration):
+		"""Remember the calibration values of a device and write the cache file."""
+		if serial == default_serial_number:
+			return
+		with self.lock:
+			self.entries[serial] = {"offset": offsets, "dac_calibration": dac_calibration, "shunt_calibration": shunt_calibration}
+			self.save()
+
+	def forget(self, serial):
+		"""Drop the cached values of a device, e.g. after new values were saved to its flash memory."""
+		with self.lock:
+			if self.entries.pop(serial, None) is not None:
+				self.save()
+
+	def save(self):
+		try:
+			json.dump(self.entries, open(self.filename, 'w'), indent=1)
+		except (IOError, OSError) as error:
+			messages.append("Error writing to %s: %s"%(self.filename, error))
+
+def find_devices(vid=usb_vid, pid=usb_pid):
+	"""Return a list of (serial number, USB device) pairs for all connected devices with a given vendor and product ID."""
+	devices = []
+	for device in usb.core.find(find_all=True, idVendor=vid, idProduct=pid):
+		try:
+			serial = device.serial_number
+		except (ValueError, usb.core.USBError):
+			serial = None # The string descriptor could not be read, e.g. due to missing permissions
+		devices.append((serial, device))
+	return devices
+
+def command_delay(command_string):
+	"""Return the time (in s) for which a command holds back its reply: the argument of DELAY (in ms), or 0 for any other command."""
+	if len(command_string) == 8 and command_string.startswith(b'DELAY '):
+		return int.from_bytes(command_string[6:8], 'big')/1e3
+	return 0.
+
+def is_stream_frame(response):
+	"""Check whether a packet received on EP1 IN is a data frame pushed in streaming mode rather than a command reply."""
+	return len(response) >= 16 and response[0] == stream_frame_marker and len(response) == 10+6*response[2] # 10-byte header followed by 6 bytes per sample
+
+class Sample:
+	"""A single measurement: raw ADC counts, potential (in V), current (in mA), current range, host time (in s), and the data frame flags (0 when polled)."""
+	__slots__ = ('raw_potential', 'raw_current', 'potential', 'current', 'range', 'time', 'flags')
+	def __init__(self, raw_potential, raw_current, potential, current, range_index, sample_time, flags):
+		self.raw_potential, self.raw_current, self.potential, self.current, self.range, self.time, self.flags = raw_potential, raw_current, potential, current, range_index, sample_time, flags
+
+class Device:
+	"""Connection to a single potentiostat. A background thread performs all reads from EP1 IN: data frames are decoded into the samples queue, while command replies are passed on to read_response().
+	Several devices can be used at the same time, each with its own Device object; sample times of all devices refer to the same host timer (timeit.default_timer)."""
+	def __init__(self, usb_device, calibration=None):
+		self.usb = usb_device
+		self.calibration = calibration if calibration is not None else Calibration()
+		self.binary_protocol = False # True when the firmware accepts binary opcodes (see detect_binary_protocol())
+		self.streaming = False # True when the firmware pushes its conversions to the host by itself (see stream_start())
+		self.acquisition_period = acquisition_period
+		self.current_range = 0
+		self.samples = collections.deque() # Samples unpacked from received data frames, waiting to be processed
+		self.replies = queue.Queue()
+		self.reset_stream()
+		self.running = True
+		self.reader = threading.Thread(target=self.read_loop)
+		self.reader.daemon = True
+		self.reader.start()
+
+	@property
+	def manufacturer(self):
+		return self.usb.manufacturer
+
+	@property
+	def product(self):
+		return self.usb.product
+
+	@property
+	def serial_number(self):
+		return self.usb.serial_number
+
+	def close(self):
+		"""Stop streaming and release the USB device."""
+		try:
+			self.stream_stop()
+		except usb.core.USBError:
+			pass # In case the device was already unplugged
+		self.running = False
+		self.reader.join()
+		if isinstance(self.usb, usb.core.Device):
+			usb.util.dispose_resources(self.usb)
+		else:
+			self.usb.dispose() # An emulated device (see tdstatv3_emulator.py)
+
+	def read_loop(self):
+		while self.running:
+			try:
+				response = bytes(self.usb.read(0x81,64,usb_read_timeout)) # 0x81 = read address of EP1
+			except usb.core.USBError as error:
+				if error.errno in usb_timeout_errnos:
+					continue # Nothing received yet
+				messages.append("USB read error: %s"%error)
+				break
+			if is_stream_frame(response):
+				self.decode_stream_frame(response, timeit.default_timer())
+			else:
+				self.replies.put(response)
+
+	def reset_stream(self):
+		"""Reset the data frame bookkeeping; must be done before the first frame of a new stream can arrive."""
+		self.last_stream_sequence = None # Frame counter of the last data frame received
+		self.last_stream_overflows = 0 # Overflow counter reported in the last data frame received
+		self.last_stream_tick = None # Device clock tick (in ms) of the last data frame received
+		self.stream_tick_wraps = 0 # Number of times the 32-bit device clock has wrapped around since streaming started
+		self.stream_clock_offset = 0. # Host timer value corresponding to device clock tick zero (in s)
+
+	def decode_stream_frame(self, frame, arrival_time):
+		"""Unpack the samples in a data frame pushed by the device in streaming mode (called from the reader thread)."""
+		if self.last_stream_sequence is not None and frame[1] != (self.last_stream_sequence+1)%256:
+			messages.append("Streaming: %d data frame(s) lost."%((frame[1]-self.last_stream_sequence-1)%256))
+		self.last_stream_sequence = frame[1]
+		if frame[9] != self.last_stream_overflows: # The device drops samples once its buffer is full
+			messages.append("Streaming: %d sample(s) lost because the host did not keep up."%((frame[9]-self.last_stream_overflows)%256))
+			self.last_stream_overflows = frame[9]
+		numsamples = frame[2]
+		sample_range = frame[3]%4 # Bits 0-1 of the flags hold the current range of all samples in the frame
+		tick = int.from_bytes(frame[4:8], 'little') # Device clock tick at which the first conversion in the frame was started
+		decimation = frame[8] # Number of conversions averaged into each sample
+		sample_period = decimation*self.acquisition_period
+		if self.last_stream_tick is not None and tick < self.last_stream_tick-2**31:
+			self.stream_tick_wraps += 1 # The 32-bit millisecond counter wraps around after 49.7 days
+		self.last_stream_tick = tick
+		tick += self.stream_tick_wraps*2**32
+		if self.stream_clock_offset == 0.: # Map the device clock onto the host timer using the first frame
+			self.stream_clock_offset = arrival_time-(tick+(numsamples-1)*sample_period+(decimation-1)*self.acquisition_period)/1e3
+		if len(self.samples)+numsamples > stream_queue_length: # The consumer is not keeping up
+			messages.append("Streaming: %d sample(s) dropped because the sample queue is full."%numsamples)
+			return
+		raw_values = adc_bytes_to_array(frame[10:10+6*numsamples]).reshape(-1,2) # Each sample holds a potential and a current value
+		sample_times = self.stream_clock_offset+(tick+numpy.arange(numsamples)*sample_period+(decimation-1)*self.acquisition_period/2.)/1e3 # Samples in a frame were taken in consecutive acquisition periods; a decimated sample is timed at the middle of its block
+		self.samples.extend(map(Sample, raw_values[:,0].tolist(), raw_values[:,1].tolist(), self.calibration.adc_to_potential(raw_values[:,0]).tolist(), self.calibration.adc_to_current(raw_values[:,1], sample_range).tolist(), [sample_range]*numsamples, sample_times.tolist(), [frame[3]]*numsamples))
+
+	def encode_command(self, command_string):
+		"""Translate an ASCII command string into its binary form (opcode followed by the payload) if the firmware supports it."""
+		if self.binary_protocol:
+			for opcode, (name, payload_length) in enumerate(command_opcodes):
+				if len(command_string) == len(name)+payload_length and command_string.startswith(name):
+					return bytes([0x80+opcode])+command_string[len(name):]
+		return command_string
+
+	def write_command(self, command_string):
+		"""Send a command string to the device, using the binary protocol if available."""
+		self.usb.write(0x01,self.encode_command(command_string)) # 0x01 = write address of EP1
+
+	def read_response(self, delay=0.):
+		"""Wait for the reply to a command sent to the device; delay is the time (in s) for which the command holds back its reply (see command_delay())."""
+		try:
+			return self.replies.get(timeout=usb_reply_timeout+delay)
+		except queue.Empty:
+			raise usb.core.USBError("No reply received from the USB device", errno=errno.ETIMEDOUT)
+
+	def command(self, command_string, expected_response=b'OK'):
+		"""Send a command and return its reply; raise DeviceError if the reply differs from expected_response (unless that is None)."""
+		self.write_command(command_string)
+		response = self.read_response(command_delay(command_string))
+		if expected_response is not None and response != expected_response:
+			raise DeviceError("The command \"%s\" resulted in the unexpected response \"%s\""%(command_string, response))
+		return response
+
+	def send_batch(self, command_strings):
+		"""Send several commands to the device in a single transfer and return the list of replies; without the binary protocol, the commands are sent one by one."""
+		replies = []
+		if not self.binary_protocol:
+			for command_string in command_strings:
+				self.write_command(command_string)
+				replies.append(self.read_response(command_delay(command_string)))
+			return replies
+		self.usb.write(0x01,bytes([0xFF])+b''.join(self.encode_command(command_string) for command_string in command_strings)) # 0xFF marks a batch of binary commands
+		response = self.read_response(sum(map(command_delay, command_strings)))
+		while len(response) > 0: # Each reply is preceded by its length
+			replies.append(response[1:1+response[0]])
+			response = response[1+response[0]:]
+		return replies
+
+	def detect_binary_protocol(self):
+		"""Check whether the firmware accepts binary opcodes; older firmware replies "?" to them."""
+		self.usb.write(0x01,bytes([0x91])) # Binary form of "STREAM STOP", which is harmless at this point
+		self.binary_protocol = (self.read_response() == b'OK')
+		return self.binary_protocol
+
+	def stream_start(self):
+		"""Put the device in streaming mode, in which it sends every completed conversion without being polled. Returns False if the firmware does not support this."""
+		period = self.acquisition_period
+		if self.command(b'STREAM PERIOD '+bytes([period//256, period%256]), None) != b'OK': # Older firmware replies "?"
+			return False
+		self.reset_stream()
+		if self.command(b'STREAM START', None) != b'OK':
+			return False
+		self.streaming = True
+		self.samples.clear()
+		return True
+
+	def stream_stop(self):
+		"""Return the device to polled mode (see stream_start())."""
+		if self.streaming:
+			self.command(b'STREAM STOP', None) # Frames sent before the reply have been decoded by now, and are discarded below
+			self.streaming = False
+			self.samples.clear()
+
+	def set_stream_latency(self, latency):
+		"""Set the time (in ms) the device may hold back samples in order to pack them into fewer data frames."""
+		if self.streaming:
+			self.command(b'STREAM LATENCY '+bytes([latency//256, latency%256]))
+
+	def set_stream_decimation(self, factor):
+		"""Let the device average blocks of a given number of conversions into single streamed samples; return the number of samples the host still has to average itself."""
+		if not self.streaming:
+			return factor
+		if factor > 255: # Too many for the device, so leave the averaging to the host
+			self.command(b'DECIMATION '+bytes([1]))
+			return factor
+		self.command(b'DECIMATION '+bytes([max(1, factor)]))
+		return 1
+
+	def waveform_write(self, dac_codes):
+		"""Append up to waveform_chunk_codes DAC codes (rows of three bytes, see decimal_to_dac_codes()) to the device's playback FIFO; return the number of codes accepted and the number of free FIFO slots left."""
+		if not self.binary_protocol: # The chunk does not fit in a single packet in ASCII form
+			raise DeviceError("Waveform playback requires the binary command protocol")
+		chunk = numpy.asarray(dac_codes, dtype=numpy.uint8)[:waveform_chunk_codes].tobytes()
+		response = self.command(b'WAVEDATA '+bytes([len(chunk)//3])+chunk.ljust(3*waveform_chunk_codes, b'\x00'), None)
+		if len(response) != 2:
+			raise DeviceError("Waveform playback is not supported by the firmware")
+		return response[0], response[1]
+
+	def waveform_start(self, step_period, numcodes):
+		"""Start playing back the codes in the device's FIFO, one every step_period ms, until numcodes codes have been played back."""
+		self.command(b'WAVESTART '+bytes([step_period//256, step_period%256])+int(numcodes).to_bytes(4, 'big'))
+
+	def waveform_stop(self):
+		"""Stop the waveform playback and discard the codes left in the FIFO; the DAC keeps its last value."""
+		self.command(b'WAVESTOP')
+
+	def waveform_status(self):
+		"""Return the number of free FIFO slots, the underrun counter (number of steps at which the FIFO was empty, modulo 256), and the number of codes still to be played back."""
+		response = self.command(b'WAVESTATUS', None)
+		return response[0], response[1], int.from_bytes(response[2:6], 'big')
+
+	def read_sample(self, timeout=None):
+		"""Return the next valid measurement, or None if none arrives within the timeout (in s). In polled mode, a conversion is requested from the device."""
+		start = timeit.default_timer()
+		while timeout is None or timeit.default_timer()-start < timeout:
+			if self.streaming:
+				if len(self.samples) == 0:
+					time.sleep(0.01)
+					continue
+				sample = self.samples.popleft()
+				if not sample.flags & stream_flag_invalid: # Samples taken during a relay transition are dropped
+					return sample
+			else:
+				time.sleep(acquisition_period/1e3)
+				response = self.command(b'ADCREAD', None)
+				if response in (b'WAIT', b'BUSY'): # The conversion has not yet finished, or the device is taking conversions by itself (see stream_service() in main.c)
+					continue
+				raw_potential = twocomplement_to_decimal(response[0], response[1], response[2])
+				raw_current = twocomplement_to_decimal(response[3], response[4], response[5])
+				return Sample(raw_potential, raw_current, self.calibration.adc_to_potential(raw_potential), self.calibration.adc_to_current(raw_current, self.current_range), self.current_range, timeit.default_timer(), 0)
+		return None
+
+	def read_offset(self):
+		"""Return the potential and current offset stored in flash memory, or None if none have been stored."""
+		return decode_offset(self.command(b'OFFSETREAD', None))
+
+	def read_shunt_calibration(self):
+		"""Return the shunt calibration values stored in flash memory, or None if none have been stored."""
+		return decode_shunt_calibration(self.command(b'SHUNTCALREAD', None))
+
+	def read_dac_calibration(self):
+		"""Return the DAC offset and gain stored in flash memory, or None if none have been stored."""
+		return decode_dac_calibration(self.command(b'DACCALGET', None))
+
+	def read_calibration(self):
+		"""Return the offsets, DAC calibration and shunt calibration stored in flash memory (each None if not stored), in a single command if the firmware supports it."""
+		response = self.command(b'CALREAD', None)
+		if len(response) != 18: # Older firmware replies "?"
+			return self.read_offset(), self.read_dac_calibration(), self.read_shunt_calibration()
+		return decode_offset(response[0:6]), decode_dac_calibration(response[6:12]), decode_shunt_calibration(response[12:18])
+
+	def dac_calibration_finished(self):
+		"""Return True once the DAC self-calibration started by DACCAL has finished and its result has been saved."""
+		return self.command(b'CALSTATUS', None) != b'WAIT' # Older firmware replies "?", but only replies to DACCAL after finishing
+
+	def read_stats(self, reset=False):
+		"""Return the performance counters of firmware built with "make STATS=1" as a dictionary, or None if the firmware does not keep them.
+		Execution time counters hold the number of measurements and the minimum, mean and maximum time (in us); only counters that measured something are included."""
+		def counter(argument):
+			response = self.command(b'STATS '+bytes([argument]), None)
+			count, minimum, maximum, total = int.from_bytes(response[0:2], 'big'), int.from_bytes(response[2:4], 'big'), int.from_bytes(response[4:6], 'big'), int.from_bytes(response[6:10], 'big')
+			return {"count": count, "min_us": 1e6*perf_timer_period*minimum, "mean_us": 1e6*perf_timer_period*total/count, "max_us": 1e6*perf_timer_period*maximum} if count > 0 else None
+		response = self.command(b'STATS '+bytes([0xFE]), None)
+		if len(response) != 7: # Firmware without performance counters replies "?"
+			return None
+		stats = {"events": {"wait_replies": int.from_bytes(response[0:2], 'big'), "ep1_busy": int.from_bytes(response[2:4], 'big'), "dropped_samples": int.from_bytes(response[4:6], 'big')}, "counters": {},
+			"timed_command": command_opcodes[response[6]-0x80][0].decode().strip() if 0x80 <= response[6] < 0x80+len(command_opcodes) else None}
+		for index, name in enumerate(perf_counter_names):
+			values = counter(index)
+			if values is not None:
+				stats["counters"][name] = values
+		if reset:
+			self.command(b'STATS '+bytes([0xFF]))
+		return stats
+
+	def select_stats_command(self, name):
+		"""Let firmware built with "make STATS=1" time the handler of the command with a given ASCII name (e.g. b'ADCREAD') in its "command" counter, which is cleared; only one command is timed at a time."""
+		names = [command_name.strip() for command_name, payload_length in command_opcodes]
+		self.command(b'STATS '+bytes([0x80+names.index(name.strip())]))
+
+	def calibrate_dac(self, cache=None):
+		"""Run the DAC self-calibration and wait until its result has been saved to flash memory; the cached calibration of the device, if any, is dropped."""
+		self.command(b'DACCAL')
+		if cache is not None:
+			cache.forget(self.serial_number)
+		starttime = timeit.default_timer()
+		while not self.dac_calibration_finished():
+			if timeit.default_timer()-starttime > dac_calibration_timeout:
+				raise DeviceError("The DAC self-calibration did not finish")
+			time.sleep(dac_calibration_poll_interval)
+
+	def load_calibration(self, cache=None):
+		"""Apply the offset and shunt calibration stored in the device's flash memory to self.calibration, taking them from a CalibrationCache instead if it holds them."""
+		values = cache.lookup(self.serial_number) if cache is not None else None
+		if values is None:
+			values = self.read_calibration()
+			if cache is not None:
+				cache.store(self.serial_number, *values)
+		offsets, dac_calibration, shunt_calibration = values
+		if offsets is not None:
+			self.calibration.potential_offset, self.calibration.current_offset = offsets
+		if shunt_calibration is not None:
+			self.calibration.shunt_calibration[:] = shunt_calibration
+
+	def connect(self, cache=None):
+		"""Bring the device into a known state after opening it: detect the command protocol, load the calibration (see load_calibration()), switch the cell off, and start streaming if supported."""
+		self.detect_binary_protocol()
+		self.load_calibration(cache)
+		self.set_cell(False)
+		self.set_control_mode(False)
+		self.set_current_range(0)
+		self.stream_start()
+
+	def set_cell(self, cell_on):
+		"""Switch the cell connection (True = cell on, False = cell off)."""
+		self.command(b'CELL ON' if cell_on else b'CELL OFF')
+
+	def set_control_mode(self, galvanostatic):
+		"""Switch the control mode (True = galvanostatic, False = potentiostatic)."""
+		self.command(b'GALVANOSTATIC' if galvanostatic else b'POTENTIOSTATIC')
+
+	def set_current_range(self, index):
+		"""Switch the current range (0 = 20 mA, 1 = 200 uA, 2 = 2 uA)."""
+		self.command([b'RANGE 1',b'RANGE 2',b'RANGE 3'][index])
+		self.current_range = index
+
+	def set_potential(self, value):
+		"""Set the DAC output to a potential (in V), for potentiostatic control."""
+		self.command(b'DACSET '+self.calibration.potential_to_dac_bytes(value))
+
+	def set_current(self, value):
+		"""Set the DAC output to a current (in mA) in the present current range, for galvanostatic control."""
+		self.command(b'DACSET '+self.calibration.current_to_dac_bytes(value, self.current_range))
+
+def open_device(serial=None, vid=usb_vid, pid=usb_pid, cache=None):
+	"""Open and initialize the device with a given serial number (or the first device found if serial is None), optionally taking its calibration from a CalibrationCache; raise IOError if it is not found."""
+	for device_serial, usb_device in find_devices(vid, pid):
+		if serial is None or device_serial == serial:
+			device = Device(usb_device)
+			device.connect(cache)
+			return device
+	raise IOError("No USB device was found with VID 0x%04x and PID 0x%04x%s"%(vid, pid, " and serial number %s"%serial if serial is not None else ""))
+
+def require_streaming(device):
+	if not device.streaming:
+		raise DeviceError("This technique requires firmware with streaming support")
+
+def record(device, duration, writer, numsamples=1, stop_event=None, starttime=None):
+	"""Record potential and current for a given duration (in s; None means until stop_event is set), writing time (in s), potential (in V) and current (in A) to writer.
+	Times are counted from starttime (a timeit.default_timer() value, by default the start of the recording), so recordings from several devices can share a time axis."""
+	average = device.set_stream_decimation(numsamples)
+	time_data, potential_data, current_data = AverageBuffer(average), AverageBuffer(average), AverageBuffer(average)
+	if starttime is None:
+		starttime = timeit.default_timer()
+	try:
+		while (duration is None or timeit.default_timer()-starttime < duration) and not (stop_event is not None and stop_event.is_set()):
+			sample = device.read_sample(timeout=1.)
+			if sample is None:
+				continue
+			time_data.add_sample(sample.time-starttime)
+			potential_data.add_sample(sample.potential)
+			current_data.add_sample(1e-3*sample.current) # Convert mA to A
+			if len(time_data.samples) == 0:
+				writer.write(time_data.averagebuffer[-1], potential_data.averagebuffer[-1], current_data.averagebuffer[-1])
+	finally:
+		device.set_stream_decimation(1)
+
+def cyclic_voltammetry(device, lbound, ubound, startpot, stoppot, scanrate, numcycles, writer, numsamples=1, enabled_ranges=(0,1,2), stop_event=None):
+	"""Run a staircase CV (potentials in V, scan rate in V/s) on the device's sweep engine, with autoranging over enabled_ranges; write time (in s), potential (in V) and current (in A) to writer. Return the charges (in uAh) between zero crossings."""
+	require_streaming(device)
+	device.set_control_mode(False) # Potentiostatic control
+	device.set_current_range(enabled_ranges[0])
+	device.set_potential(startpot)
+	device.set_cell(True)
+	average = device.set_stream_decimation(numsamples)
+	time_data, potential_data, current_data = AverageBuffer(average), AverageBuffer(average), AverageBuffer(average)
+	device.command(autorange_command(device.calibration, enabled_ranges))
+	device.command(cv_sweep_command(device.calibration, startpot, ubound, lbound, stoppot, scanrate, numcycles))
+	started = False # Samples taken before the sweep started may still arrive, as the device only ships them once a sample with different flags is stored
+	starttime = timeit.default_timer()
+	try:
+		while not (stop_event is not None and stop_event.is_set()):
+			sample = device.read_sample(timeout=1.)
+			if sample is None:
+				continue
+			if not started:
+				started = bool(sample.flags & stream_flag_sweep)
+				if not started:
+					continue # Taken before the sweep started
+			if not sample.flags & stream_flag_sweep: # This signifies the end of the CV scan
+				break
+			time_data.add_sample(sample.time-starttime)
+			potential_data.add_sample(sample.potential)
+			current_data.add_sample(1e-3*sample.current) # Convert mA to A
+			if len(time_data.samples) == 0:
+				writer.write(time_data.averagebuffer[-1], potential_data.averagebuffer[-1], current_data.averagebuffer[-1])
+	finally:
+		device.command(b'CVSTOP') # Stop the sweep engine in case it is still running
+		device.command(autorange_command(device.calibration, []))
+		device.set_cell(False)
+		device.set_stream_decimation(1)
+	return charge_from_cv(time_data.averagebuffer, current_data.averagebuffer)
+
+def play_waveform(device, potentials, step_period, writer, numsamples=1, stop_event=None):
+	"""Apply an arbitrary sequence of potentials (in V), one every step_period ms, using the device's waveform playback; write time (in s), potential (in V) and current (in A) to writer.
+	The codes are streamed to the device while it plays them back. Return the number of underruns (modulo 256), i.e. steps at which the device ran out of codes."""
+	require_streaming(device)
+	dac_codes = device.calibration.potential_to_dac_codes(potentials)
+	device.set_control_mode(False) # Potentiostatic control
+	device.command(b'DACSET '+dac_codes[0].tobytes())
+	device.set_cell(True)
+	average = device.set_stream_decimation(numsamples)
+	time_data, potential_data, current_data = AverageBuffer(average), AverageBuffer(average), AverageBuffer(average)
+	sent = 0
+	free = 1
+	device.waveform_stop() # Start with an empty FIFO
+	underruns = 0
+	try:
+		while sent < len(dac_codes) and free > 0: # Fill the FIFO before starting
+			accepted, free = device.waveform_write(dac_codes[sent:sent+waveform_chunk_codes])
+			sent += accepted
+		device.waveform_start(step_period, len(dac_codes))
+		started = False # Samples taken before the playback started may still arrive, as the device only ships them once a sample with different flags is stored
+		finished = False # Set by the first sample taken after the last code was played back, so the samples of the final steps are not lost
+		ended = None # Host time at which the device was first seen to have played back all codes
+		starttime = timeit.default_timer()
+		while not finished and not (stop_event is not None and stop_event.is_set()):
+			while sent < len(dac_codes) and free > 0: # Top up the FIFO
+				accepted, free = device.waveform_write(dac_codes[sent:sent+waveform_chunk_codes])
+				sent += accepted
+			while len(device.samples) > 0:
+				sample = device.samples.popleft()
+				if not started:
+					started = bool(sample.flags & stream_flag_sweep)
+					if not started:
+						if ended is not None and sample.time > ended: # The waveform was too short to be sampled
+							finished = True
+							break
+						continue # Taken before the playback started
+				if not sample.flags & stream_flag_sweep: # This signifies the end of the playback
+					finished = True
+					break
+				if sample.flags & stream_flag_invalid: # Samples taken during a relay transition are dropped
+					continue
+				time_data.add_sample(sample.time-starttime)
+				potential_data.add_sample(sample.potential)
+				current_data.add_sample(1e-3*sample.current) # Convert mA to A
+				if len(time_data.samples) == 0:
+					writer.write(time_data.averagebuffer[-1], potential_data.averagebuffer[-1], current_data.averagebuffer[-1])
+			free, underruns, codes_left = device.waveform_status()
+			if codes_left == 0 and ended is None:
+				ended = timeit.default_timer()
+			time.sleep(waveform_poll_interval)
+	finally:
+		device.waveform_stop()
+		device.set_cell(False)
+		device.set_stream_decimation(1)
+	return underruns
+
+def charge_discharge(device, chargecurrent, dischargecurrent, ubound, lbound, numcycles, writer, numsamples=1, stop_event=None):
+	"""Run galvanostatic charge/discharge cycles (currents in mA, potential limits in V) on the device's controller, for numcycles half cycles; write time (in s), potential (in V) and current (in A) to writer. Return the charge (in Ah) of each half cycle."""
+	require_streaming(device)
+	device.set_stream_latency(1000) # Cut-off checks run on the device, so samples can be packed into full frames
+	device.set_current_range(current_range_from_current(chargecurrent))
+	device.set_current(chargecurrent)
+	device.set_control_mode(True) # Galvanostatic control
+	average = device.set_stream_decimation(numsamples)
+	time_data, potential_data, current_data = AverageBuffer(average), AverageBuffer(average), AverageBuffer(average)
+	charge_data = ChargeBuffer()
+	charges = []
+	device.set_cell(True)
+	device.command(cd_start_command(device.calibration, [chargecurrent, dischargecurrent], numcycles, ubound, lbound, device.current_range, True))
+	started = False # Samples taken before the controller started may still arrive, as the device only ships them once a sample with different flags is stored
+	phase = 0
+	starttime = timeit.default_timer()
+	try:
+		while not (stop_event is not None and stop_event.is_set()):
+			sample = device.read_sample(timeout=1.)
+			if sample is None:
+				continue
+			if not started:
+				started = bool(sample.flags & stream_flag_cd)
+				if not started:
+					continue # Taken before the controller started
+			sample_phase = 1 if sample.flags & stream_flag_cd_phase else 0
+			if not sample.flags & stream_flag_cd or sample_phase != phase: # The controller crossed a potential limit before taking this sample
+				charges.append(abs(charge_data.charge))
+				charge_data.clear()
+				phase = sample_phase
+				if not sample.flags & stream_flag_cd: # The controller has finished its last half cycle
+					break
+			time_data.add_sample(sample.time-starttime)
+			potential_data.add_sample(sample.potential)
+			current_data.add_sample(1e-3*sample.current) # Convert mA to A
+			if len(time_data.samples) == 0:
+				writer.write(time_data.averagebuffer[-1], potential_data.averagebuffer[-1], current_data.averagebuffer[-1])
+				charge_data.add_point(time_data.averagebuffer[-1], current_data.averagebuffer[-1])
+	finally:
+		device.command(b'CDSTOP')
+		device.set_cell(False)
+		device.set_control_mode(False)
+		device.set_stream_latency(stream_latency)
+		device.set_stream_decimation(1)
+	return charges
@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+# This program checks that the host software and the emulator use the firmware's command table: the binary opcode of a command is 0x80 plus its index in that
+# table, so a command inserted in main.c without updating tdstatv3_engine.py would silently shift every opcode after it. Run it with "python3 -m unittest" from this
+# directory. It requires the same packages as tdstatv3_engine.py (Python 3.x, Numpy, and PyUSB).
+
+# Author: Thomas Dobbelaere
+# License: GPL
+
+import os
+import re
+import unittest
+import tdstatv3_engine as engine
+import tdstatv3_emulator
+
+firmware_directory = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "firmware")
+
+def firmware_defines():
+	"""Return the numeric macros of main.c and usb_config.h, which the payload lengths in the command table refer to."""
+	defines = {}
+	for filename in ("usb_config.h", "main.c"):
+		with open(os.path.join(firmware_directory, filename)) as f:
+			for name, value in re.findall(r"^#define (\w+) (\d+)\b", f.read(), re.MULTILINE):
+				defines[name] = int(value)
+	return defines
+
+def firmware_command_table():
+	"""Return the command table of main.c as a list of (ASCII name, payload length, name length) tuples, in opcode order."""
+	with open(os.path.join(firmware_directory, "main.c")) as f:
+		source = f.read()
+	table = source[source.index("static const struct command commands[] = {"):]
+	table = table[:table.index("};")]
+	defines = firmware_defines()
+	return [(name.encode(), eval(payload_length, {}, defines), int(name_length)) for payload_length, name, name_length in re.findall(r'\{command_\w+, ([^,]+), "([^"]*)", (\d+)\}', table)]
+
+class CommandTableTest(unittest.TestCase):
+	def test_engine_matches_firmware(self):
+		self.assertEqual([(name, payload_length) for name, payload_length, name_length in firmware_command_table()], engine.command_opcodes)
+
+	def test_name_lengths(self):
+		for name, payload_length, name_length in firmware_command_table():
+			self.assertEqual(len(name), name_length, name)
+
+	def test_emulator_matches_engine(self):
+		self.assertEqual(engine.command_opcodes[-1][0], b'STATS ') # Only in firmware built with "make STATS=1", so it must stay last
+		for stats in (False, True):
+			device = tdstatv3_emulator.EmulatedDevice(stats=stats)
+			try:
+				self.assertEqual([(name, payload_length) for handler, payload_length, name in device.commands], engine.command_opcodes if stats else engine.command_opcodes[:-1])
+			finally:
+				device.shutdown()
+
+if __name__ == "__main__":
+	unittest.main()